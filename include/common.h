@@ -20,18 +20,40 @@
 #define SEGMENT_LEN     FIRST_LV_LEN
 #define PAGE_LEN        SECOND_LV_LEN
 
+#define NUM_REGS	10
+
 #define NUM_PAGES	(1 << (ADDRESS_SIZE - OFFSET_LEN))
 #define PAGE_SIZE	(1 << OFFSET_LEN)
 
 enum ins_opcode_t {
-	CALC,	// Just perform calculation, only use CPU
+	CALC,	// Just perform calculation, only use CPU. arg_0 = run length
 	ALLOC,	// Allocate memory
 #ifdef MM_PAGING
 	MALLOC, // Allocate dynamic memory
 #endif
 	FREE,	// Deallocated a memory block
 	READ,	// Write data to a byte on memory
-	WRITE	// Read data from a byte on memory
+	WRITE,	// Read data from a byte on memory
+#ifdef MM_PAGING
+	FILL,	// Set a block of bytes in a region to a value
+	COPY,	// Copy a block of bytes between regions
+	LOAD32,	// Load a 32-bit word from memory to a register
+	STORE32,	// Store a register to a 32-bit word on memory
+	LOAD64,	// Load a 64-bit word from memory to a register pair
+	STORE64,	// Store a register pair to a 64-bit word on memory
+#endif
+	IO,	// Block on a request to the I/O device. arg_0 = latency in slots
+	SLEEP,	// Leave the CPU for a number of slots. arg_0 = slots
+	YIELD,	// Give up the rest of the time slot
+#ifdef MM_PAGING
+	FORK,	// Clone the process, memory is shared copy-on-write. arg_0 = register for the child PID
+	SHMGET,	// Create a shared memory segment unless it exists. arg_0 = key, arg_1 = size
+	SHMAT,	// Map a shared memory segment as a region. arg_0 = key, arg_1 = region
+	THREAD,	// Start a thread sharing the memory of the process. arg_0 = register for the thread PID
+	SEND,	// Move a region to a message queue. arg_0 = queue key, arg_1 = region
+	RECV,	// Map the next message of a queue as a region, block while it is empty. arg_0 = queue key, arg_1 = region
+#endif
+	NUM_OPCODES	// Number of opcodes, keep it last
 };
 
 /* instructions executed by the CPU */
@@ -40,11 +62,46 @@ struct inst_t {
 	uint32_t arg_0; // Argument lists for instructions
 	uint32_t arg_1;
 	uint32_t arg_2;
+	uint32_t arg_3;
+	uint32_t arg_4;
+};
+
+#ifdef PROFILE
+/* Profile of one instruction of a code segment */
+struct prof_ent_t {
+	uint64_t exec;	// Times the instruction was retired
+	uint64_t slot;	// Slots spent running it
+	uint64_t fault;	// Page faults it triggered
+	uint64_t swap;	// Pages it swapped in or out
+};
+#endif
+
+/* Encoded instruction of a code segment. Up to two arguments are kept
+ * inline, otherwise they are in the operand pool of the segment */
+#define CODE_NARGS	0x07	// Number of arguments
+#define CODE_POOL	0x80	// Arguments start at pool[arg32]
+
+struct code_ins_t {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t arg16;	// arg_0 of a two-argument instruction
+	uint32_t arg32;	// Last inline argument or pool index
 };
 
 struct code_seg_t {
-	struct inst_t * text;
+	const struct code_ins_t * text;
+	const uint32_t * pool;	// Operand pool
 	uint32_t size;
+	uint32_t priority;	// Default priority of the program
+	char * path;	// Program the segment was loaded from
+	uint64_t version;	// Version of the program file, see parse_open()
+	uint32_t refs;	// Processes running the segment
+	void * image;	// Mapping of a compiled program, NULL for a parsed one
+	size_t image_size;
+	struct code_seg_t * next;	// Next interned segment
+#ifdef PROFILE
+	const uint32_t * line;	// Source line of each instruction, NULL if unknown
+#endif
 };
 
 struct trans_table_t {
@@ -66,31 +123,79 @@ struct page_table_t {
 	int size;	// Number of row in the first layer
 };
 
-/* PCB, describe information about a process */
+#define PERF_NUM_SZCLASS 4
+
+#ifdef PERFCTR
+/* Performance counters of a process, only updated by the CPU that runs it.
+ * The slot accounting comes first, it is updated on every slot */
+struct perf_ctr_t {
+	uint64_t slot_wait;	// Slots spent in the ready queue
+	uint64_t slot_run;	// Slots spent on a CPU
+	uint64_t slot_blocked;	// Slots spent blocked on I/O or a message, or asleep
+	uint64_t ready_since;	// Slot the process last entered the ready queue
+	uint64_t blocked_since;	// Slot the process last blocked at
+	uint64_t ins_retired[NUM_OPCODES]; // Instructions retired by opcode
+	uint64_t pgfault;	// Accesses to a page not in MEMRAM
+	uint64_t swapin;	// Pages copied from MEMSWP to MEMRAM
+	uint64_t swapout;	// Pages copied from MEMRAM to MEMSWP
+	uint64_t lru_update;	// Insertions and moves in the LRU list
+	uint64_t cowcopy;	// Frames copied on the first write to a shared page
+	uint64_t alloc[PERF_NUM_SZCLASS]; // Region allocations by size class
+	uint64_t free[PERF_NUM_SZCLASS];  // Region frees by size class
+};
+#endif
+
+/* Scheduling state of a process */
+enum proc_state_t {
+	PROC_RUNNABLE,	// On a CPU or in the ready queue
+	PROC_BLOCKED,	// Off every queue, waiting for an event
+	PROC_YIELDED	// Gave up the rest of its time slot
+};
+
+#define PCB_ALIGN	64	// Cache line size
+
+/* PCB, describe information about a process. What the CPU reads on every
+ * slot comes first and fills the first two cache lines together with the
+ * slot accounting of [perf], the rest is only read by the instructions
+ * and at load and exit. PCBs come from alloc_pcb() */
 struct pcb_t {
+	/* Hot part */
 	uint32_t pid;	// PID
-	uint32_t priority; // Default priority, this legacy (FIXED) value depend on process itself
-	struct code_seg_t * code;	// Code segment
-	addr_t regs[10]; // Registers, store address of allocated regions
+	enum proc_state_t state; // Set to PROC_BLOCKED by an instruction that waits
 	uint32_t pc; // Program pointer, point to the next instruction
+	uint32_t pc_rep; // Iterations of the counted instruction at pc already retired
 #ifdef MLQ_SCHED
 	// Priority on execution (if supported), on-fly aka. changeable
 	// and this vale overwrites the default priority when it existed
 	uint32_t prio;     
 #endif
+	struct code_seg_t * code;	// Code segment, shared by every process running the program
 #ifdef MM_PAGING
 	struct mm_struct *mm;
 	struct memphy_struct *mram;
+#endif
+	addr_t regs[NUM_REGS]; // Registers, store address of allocated regions
+#ifdef PERFCTR
+	struct perf_ctr_t perf;
+#endif
+
+	/* Cold part */
+	uint32_t priority; // Default priority, this legacy (FIXED) value depend on process itself
+#ifdef MM_PAGING
 	struct memphy_struct **mswp;
 	struct memphy_struct *active_mswp;
 #ifdef MM_PAGING_HEAP_GODOWN
 	uint32_t vmemsz;
 #endif
-#endif
+#else
 	struct page_table_t * page_table; // Page table
 	uint32_t bp;	// Break pointer
+#endif
+#ifdef PROFILE
+	struct prof_ent_t * prof;	// Profile of each instruction of the code segment
+#endif
 
-};
+} __attribute__((aligned(PCB_ALIGN)));
 
 // Implement LRU replacement algorithm
 // with doubly linked list
@@ -9,5 +9,10 @@
  * Otherwise, return 1. */
 int run(struct pcb_t * proc);
 
+/* Fast-forward the counted CALC at the current pc of [proc] by at most
+ * [budget] slots. Return the number of slots consumed, or 0 if the
+ * current instruction is not a CALC. */
+uint32_t run_calc(struct pcb_t * proc, uint32_t budget);
+
 #endif
 
@@ -0,0 +1,29 @@
+#ifndef IODEV_H
+#define IODEV_H
+
+#include "common.h"
+
+/* Submit an I/O request that keeps the device busy for [latency] slots
+ * and block [proc] until it completes. The device serves requests in
+ * order, one at a time. Return 0 if the request is queued */
+int io_submit(struct pcb_t * proc, uint32_t latency);
+
+/* Put [proc], blocked on something other than the device, back to the
+ * ready queue at the next slot. A process blocks while it is still on
+ * its CPU, so waking it up here rather than right away keeps it from
+ * being dispatched twice. Return 0 */
+int io_wakeup(struct pcb_t * proc);
+
+/* Block [proc] for [slots] time slots, at least one. Sleepers are kept
+ * ordered by wake slot. Return 0 */
+int io_sleep(struct pcb_t * proc, uint32_t slots);
+
+/* Complete every request that is done by slot [now] and put its process
+ * back to the ready queue. Return the number of completed requests */
+int io_complete(uint64_t now);
+
+/* Number of requests, wake-ups and sleepers not completed yet */
+int io_pending(void);
+
+#endif
+
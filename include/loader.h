@@ -3,7 +3,87 @@
 
 #include "common.h"
 
+/* Header of a compiled program, followed by the text, the operand
+ * pool and, with PROG_LINES, the source line of each instruction.
+ * Fields are in host byte order */
+#define PROG_MAGIC	"OSIM"
+#define PROG_VERSION	1
+#define PROG_LINES	0x1
+
+struct prog_hdr_t {
+	char magic[4];
+	uint16_t version;
+	uint16_t nopcodes;	// NUM_OPCODES of the build that compiled it
+	uint32_t priority;
+	uint32_t size;	// Instructions in the text
+	uint32_t npool;	// Words in the operand pool
+	uint32_t flags;
+	uint32_t checksum;	// FNV-1a of everything after the header
+	uint32_t reserved;
+};
+
+/* Decode the instruction at [pc] of a code segment */
+static inline void code_fetch(const struct code_seg_t * code, uint32_t pc,
+		struct inst_t * ins) {
+	const struct code_ins_t * c = &code->text[pc];
+	uint32_t args[5] = {0, 0, 0, 0, 0};
+	uint32_t i, nargs = c->flags & CODE_NARGS;
+
+	if (c->flags & CODE_POOL) {
+		for (i = 0; i < nargs; i++) {
+			args[i] = code->pool[c->arg32 + i];
+		}
+	}else if (nargs == 1) {
+		args[0] = c->arg32;
+	}else if (nargs == 2) {
+		args[0] = c->arg16;
+		args[1] = c->arg32;
+	}
+	ins->opcode = (enum ins_opcode_t)c->opcode;
+	ins->arg_0 = args[0];
+	ins->arg_1 = args[1];
+	ins->arg_2 = args[2];
+	ins->arg_3 = args[3];
+	ins->arg_4 = args[4];
+}
+
+/* Load the code of a program, either a text one or one compiled by
+ * compile_code(), which is mapped as is. A program already loaded and
+ * unchanged since gets its segment shared instead. Return NULL, with
+ * the error reported, if the program cannot be loaded */
+struct code_seg_t * load_code(const char * path, uint32_t * priority);
+
+/* Drop a reference to a code segment, the last one frees it */
+void put_code(struct code_seg_t * code);
+
+/* Compile the program text at [src] to a binary at [dst] */
+int compile_code(const char * src, const char * dst);
+
+/* Create a PCB running the program at [path], NULL if it cannot be
+ * loaded */
 struct pcb_t * load(const char * path);
 
+/* Same as load() but the PCB gets no PID, so that processes prepared
+ * ahead of their arrival are numbered in the order they arrive */
+struct pcb_t * load_pcb(const char * path);
+
+/* Give the next PID to a PCB made by load_pcb() */
+void assign_pid(struct pcb_t * proc);
+
+/* Take a PCB from the pool, its fields are left to the caller */
+struct pcb_t * alloc_pcb(void);
+
+/* Drop the code segment of a finished PCB and give it back to the pool,
+ * its memory is left to the caller */
+void free_pcb(struct pcb_t * proc);
+
+/* Create a PCB copying the registers, pc and code of [parent], the code
+ * segment is shared. The
+ * memory of the child is left to the caller */
+struct pcb_t * clone_pcb(const struct pcb_t * parent);
+
+/* Number of PCBs created so far, loaded or cloned */
+uint32_t proc_count(void);
+
 #endif
 
@@ -29,6 +29,7 @@
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
 #define PAGING_PTE_RESERVE_MASK BIT(29)
+#define PAGING_PTE_COW_MASK PAGING_PTE_RESERVE_MASK /* frame shared until the next write */
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
@@ -36,6 +37,8 @@
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
 #define PAGING_PTE_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
+#define PAGING_PTE_PAGE_SWAPPED(pte) (pte&PAGING_PTE_SWAPPED_MASK)
+#define PAGING_PTE_PAGE_COW(pte) (pte&PAGING_PTE_COW_MASK)
 
 /* USRNUM */
 #define PAGING_PTE_USRNUM_LOBIT 15
@@ -54,6 +57,12 @@
 #define PAGING_PTE_USRNUM_MASK GENMASK(PAGING_PTE_USRNUM_HIBIT,PAGING_PTE_USRNUM_LOBIT)
 #define PAGING_PTE_FPN_MASK    GENMASK(PAGING_PTE_FPN_HIBIT,PAGING_PTE_FPN_LOBIT)
 #define PAGING_PTE_SWPTYP_MASK GENMASK(PAGING_PTE_SWPTYP_HIBIT,PAGING_PTE_SWPTYP_LOBIT)
+
+/* A swapped page of this type has no swap frame, it was all zeroes
+ * when evicted and comes back as a zeroed frame */
+#define PAGING_SWPTYP_ZERO (int)(PAGING_PTE_SWPTYP_MASK >> PAGING_PTE_SWPTYP_LOBIT)
+#define PAGING_PTE_PAGE_ZERO(pte) (PAGING_PTE_PAGE_SWAPPED(pte) \
+        && !PAGING_PTE_PAGE_PRESENT(pte) && PAGING_SWPTYP(pte) == PAGING_SWPTYP_ZERO)
 #define PAGING_PTE_SWPOFF_MASK GENMASK(PAGING_PTE_SWPOFF_HIBIT,PAGING_PTE_SWPOFF_LOBIT)
 
 /* Extract PTE */
@@ -133,6 +142,17 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 int __free(struct pcb_t *caller, int rgid);
 int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data);
 int __write(struct pcb_t *caller, int rgid, int offset, BYTE value);
+int __fill(struct pcb_t *caller, int rgid, int offset, int len, BYTE value);
+int __copy(struct pcb_t *caller, int srcid, int srcoff, int dstid, int dstoff, int len);
+int __load(struct pcb_t *caller, int rgid, int offset, int width, uint64_t *value);
+int __store(struct pcb_t *caller, int rgid, int offset, int width, uint64_t value);
+int __fork(struct pcb_t *caller, struct pcb_t *child);
+int __clone_vm(struct pcb_t *caller, struct pcb_t *child);
+int free_pcb_memph(struct pcb_t *caller);
+struct memphy_struct *get_swpdev(struct pcb_t *caller, int swptyp);
+int pg_getswpfp(struct pcb_t *caller, int *swptyp, int *swpfpn);
+int pg_evict(struct pcb_t *caller, int *retfpn);
+int pg_swapin(struct pcb_t *caller, uint32_t *pte, int pgn, int *retfpn);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
 
 /* VM prototypes */
@@ -149,22 +169,111 @@ int pgwrite(
 		BYTE data, // Data to be wrttien into memory
 		uint32_t destination, // Index of destination register
 		uint32_t offset);
+int pgfill(
+		struct pcb_t * proc, // Process executing the instruction
+		BYTE data, // Data to be written into every byte of the block
+		uint32_t destination, // Index of destination region
+		uint32_t offset, // Block start = [destination] + [offset]
+		uint32_t length); // Number of bytes in the block
+int pgcopy(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source region
+		uint32_t srcoff, // Source block start = [source] + [srcoff]
+		uint32_t destination, // Index of destination region
+		uint32_t dstoff, // Destination block start = [destination] + [dstoff]
+		uint32_t length); // Number of bytes in the block
+int pgshmget(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t key, // Key of the segment
+		uint32_t size); // Segment size in bytes
+int pgshmat(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t key, // Key of the segment
+		uint32_t reg_index); // Region the segment is mapped as
+int pgsend(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t key, // Key of the message queue
+		uint32_t reg_index); // Region sent, unmapped from the process
+int pgrecv(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t key, // Key of the message queue
+		uint32_t reg_index); // Region the message is mapped as
+void msg_dump(void); // Report processes still blocked on RECV
+int pgload(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source region
+		uint32_t offset, // Source address = [source] + [offset]
+		uint32_t destination, // Index of destination register
+		int width); // Access width in bytes, 4 or 8
+int pgstore(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source register
+		uint32_t destination, // Index of destination region
+		uint32_t offset, // Destination address = [destination] + [offset]
+		int width); // Access width in bytes, 4 or 8
 /* Local VM prototypes */
 struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
+int enlist_vm_freerg_list(struct mm_struct *mm, int vmaid, struct vm_rg_struct* rg_elmt);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int* inc_limit_ret);
-int find_victim_page(struct mm_struct* mm, int *pgn);
+int find_victim_page(struct mm_struct* mm, struct memphy_struct *mram, int *pgn);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
 
+/* Shared memory prototypes, MEM_in_use held */
+int shm_get(struct pcb_t *caller, uint32_t key, uint32_t size);
+int shm_attach(struct pcb_t *caller, uint32_t key, int rgid);
+int shm_detach(struct mm_struct *mm, int rgid);
+int shm_attached(struct mm_struct *mm, int pgn);
+int shm_fork(struct mm_struct *mm, struct mm_struct *cmm);
+int shm_exit(struct mm_struct *mm);
+int shm_swapout(struct memphy_struct *mram, int fpn, int swptyp, int swpoff);
+int shm_swapin(struct memphy_struct *mram, int swptyp, int swpoff, int fpn);
+
+/* Compressed swap prototypes, mutex of the device held */
+struct zram_struct *zram_create(int nslots, int pagesz);
+void zram_free(struct zram_struct *z, int slot);
+int zram_store(struct zram_struct *z, int slot, const BYTE *page);
+int zram_load(struct zram_struct *z, int slot, BYTE *page);
+int zram_dup(struct zram_struct *src, int srcslot, struct zram_struct *dst, int dstslot);
+void zram_dump(struct zram_struct *z, int id);
+
+/* Swap I/O prototypes, MEM_in_use held */
+int swapio_start(int nthread);
+void swapio_stop(void);
+int swapio_read(struct memphy_struct *mswp, int swpoff, BYTE *page);
+int swapio_write(struct memphy_struct *mram, int fpn, struct memphy_struct *mswp, int swpoff);
+int swapio_copy(struct memphy_struct *src, int srcoff, struct memphy_struct *dst, int dstoff);
+int swapio_release(struct memphy_struct *mswp, int swpoff);
+void swapio_dump(void);
+
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int num, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_mag_init(struct memphy_struct *mp, int ncpu);
+void MEMPHY_set_cpu(int cpu);
+int MEMPHY_get_ref(struct memphy_struct *mp, int fpn);
+int MEMPHY_ref(struct memphy_struct *mp, int fpn);
+int MEMPHY_unref(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_shared(struct memphy_struct *mp, int fpn);
+int MEMPHY_set_shared(struct memphy_struct *mp, int fpn, int shared);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_read_buf(struct memphy_struct * mp, int addr, BYTE *buf, int len);
+int MEMPHY_write_buf(struct memphy_struct * mp, int addr, const BYTE *buf, int len);
+int MEMPHY_fill(struct memphy_struct * mp, int addr, BYTE value, int len);
+int MEMPHY_cp_page(struct memphy_struct *mpsrc, int srcfpn,
+                   struct memphy_struct *mpdst, int dstfpn, int pagesz);
+int MEMPHY_read_page(struct memphy_struct *mp, int fpn, BYTE *page, int pagesz);
+int MEMPHY_write_page(struct memphy_struct *mp, int fpn, const BYTE *page, int pagesz);
+int MEMPHY_zero_page(struct memphy_struct *mp, int fpn, int pagesz);
 int RAM_dump(struct memphy_struct *mram);
 int MEMPHY_dump(struct memphy_struct * mp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg,
+                     const char *path);
+int init_memphy_zram(struct memphy_struct *mp, int max_size, int randomflg);
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
@@ -173,18 +282,20 @@ int print_list_vma(struct vm_area_struct *rg);
 
 int print_list_pgn(struct pgn_t *ip);
 int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
-/* Add mutex for synchronization */
-static pthread_mutex_t MEM_in_use;
+/* Add mutex for synchronization, one instance shared by every module.
+ * A thread changing regions takes its mm->lock first, then MEM_in_use */
+extern pthread_mutex_t MEM_in_use;
 // add LRU function
 #ifdef LRU
-static pthread_mutex_t LRU_lock;
-// declared LRU list as static so that the 
+extern pthread_mutex_t LRU_lock;
+// declared LRU list as global so that the 
 // free-frame list is system-wide
 // (the default list i.e. pgn_t* fifo_pgn is per-process)
-static struct LRU_list *lru_head;
-static struct LRU_list *lru_tail;
+extern struct LRU_list *lru_head;
+extern struct LRU_list *lru_tail;
 int add_LRU_page(uint32_t *pte, int pgn);
-int find_LRU_victim_page(int* pgn, int* fpn, uint32_t** vicpte);
+int find_LRU_victim_page(struct memphy_struct *mram, int* pgn, int* fpn, uint32_t** vicpte);
+int free_LRU_pages(uint32_t *pgd, int n);
 int print_LRU_page();
 #endif
 #endif
@@ -12,7 +12,11 @@
 #define RAM_STATUS_DUMP 1
 #define SYNC // enable synchronization
 #define LRU // use LRU replacement instead of FIFO
+#define FRAME_MAG 16 // free RAM frames cached by each CPU, unset to lock for every frame
+#define SWAP_IO 2 // host threads doing swap I/O, unset to do it on the faulting CPU
 #define IODUMP 1
 #define PAGETBL_DUMP 1
+#define PERFCTR 1 // per-process performance counters, dumped at exit
+//#define PROFILE 1 // per-instruction hotspot profile of each program, needs PERFCTR
 
 #endif
@@ -60,6 +60,12 @@ struct mm_struct {
 
    /* list of free page */
    struct pgn_t *fifo_pgn;
+
+   /* Number of threads sharing the mm, the last one frees it */
+   int mm_users;
+   /* Serializes region and vma changes of the threads with the
+    * accesses that look a region up */
+   pthread_mutex_t lock;
 };
 
 /*
@@ -84,14 +90,34 @@ struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
    int maxsz;
+   /* A set bit is a chunk of [storage] committed, NULL when all are */
+   uint64_t *chunk_map;
+   /* Compressed store of a swap with no [storage], NULL otherwise */
+   struct zram_struct *zram;
    
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
 
-   /* Management structure */
-   struct framephy_struct *free_fp_list;
-   struct framephy_struct *used_fp_list;
+   /* Management structure: a set bit of [fp_bitmap] is a frame in use,
+    * a set bit of [fp_summary] is a word of [fp_bitmap] with no free
+    * frame left. Both start zeroed, every frame free */
+   uint64_t *fp_bitmap;
+   uint64_t *fp_summary;
+   int fp_words;   // Words in fp_bitmap
+   int fp_nfree;   // Free frames
+   int fp_hint;    // Words of fp_summary below it are full
+
+   /* Number of extra mappers of each frame shared copy-on-write,
+    * 0 when the frame has a single mapper */
+   int *fp_ref;
+   /* Set for a frame owned by a shared memory segment */
+   BYTE *fp_shared;
+
+   /* Free frames cached by each CPU, NULL when every frame goes
+    * through the bitmaps */
+   struct memphy_mag_t *mag;
+   int nmag;
 };
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Single-pass tokenizer over a file mapped in memory. Tokens are
+ * separated by blanks, numbers are decimal and parsed in place, and
+ * every error is reported with the line it was found at */
+struct parse_t {
+	const char * path;	// File being parsed, for error messages
+	const char * p;	// Next character
+	const char * end;
+	uint32_t line;	// Line of the next character
+	void * image;	// Mapping made by parse_open(), NULL otherwise
+	size_t size;
+	uint64_t version;	// Inode, size and mtime of the file mixed, 0 if unknown
+};
+
+/* Map the file at [path] and start parsing it */
+int parse_open(struct parse_t * ps, const char * path);
+
+/* Start parsing [size] bytes at [data], which the caller keeps */
+void parse_init(struct parse_t * ps, const char * path, const void * data, size_t size);
+
+/* Unmap the file mapped by parse_open() */
+void parse_close(struct parse_t * ps);
+
+/* Print "[path]:[line]: [message]" */
+void parse_error(const struct parse_t * ps, const char * fmt, ...);
+
+/* Read the next token as a number, [what] names it in the error */
+int parse_u32(struct parse_t * ps, uint32_t * val, const char * what);
+int parse_u64(struct parse_t * ps, uint64_t * val, const char * what);
+
+/* Read the next token as a number, optionally followed by [sep] and a
+ * tag which points into the file. [tag] is NULL when there is none */
+int parse_u32_tag(struct parse_t * ps, uint32_t * val, char sep,
+		const char ** tag, uint32_t * len, const char * what);
+
+/* Read the next token as a word, which points into the file */
+int parse_word(struct parse_t * ps, const char ** word, uint32_t * len, const char * what);
+
+/* Number of tokens left on the current line if they all start with a
+ * digit, -1 otherwise. Nothing is consumed */
+int parse_numeric_line(const struct parse_t * ps);
+
+#endif
+
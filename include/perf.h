@@ -0,0 +1,26 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "common.h"
+
+/* Counters are plain fields of the PCB. They are only touched by the CPU
+ * that currently runs the process, so no atomics or locks are needed */
+#ifdef PERFCTR
+#define PERF_ADD(proc, ctr, n)	((proc)->perf.ctr += (n))
+#else
+#define PERF_ADD(proc, ctr, n)
+#endif
+#define PERF_INC(proc, ctr)	PERF_ADD(proc, ctr, 1)
+
+/* Size class of a [size] bytes allocation:
+ * up to 256B, up to 1KB, up to 4KB, larger */
+int perf_szclass(uint32_t size);
+
+/* Name of [opcode] as written in the program text */
+const char * perf_opname(enum ins_opcode_t opcode);
+
+/* Print the counters of [proc] as a single block */
+void perf_dump(struct pcb_t * proc);
+
+#endif
+
@@ -0,0 +1,29 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include "common.h"
+
+/* Page faults and swaps are attributed to an instruction by sampling
+ * the performance counters of the process around it */
+#if defined(PROFILE) && !defined(PERFCTR)
+#error "PROFILE needs PERFCTR"
+#endif
+
+/* Profile entries belong to the process, which only the CPU running it
+ * touches, so no locks are needed even if its code segment is shared */
+#ifdef PROFILE
+#define PROF_ADD(proc, idx, ctr, n)	((proc)->prof[idx].ctr += (n))
+#else
+#define PROF_ADD(proc, idx, ctr, n)
+#endif
+
+/* Merge the profile of [proc] into the profile of the program it was
+ * loaded from and free it */
+void prof_collect(struct pcb_t * proc);
+
+/* Print the hotspots of every program, hottest instruction first, and
+ * write the same profile to [path] in folded stack format */
+void prof_report(const char * path);
+
+#endif
+
@@ -4,11 +4,13 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
-
+/* FIFO of processes kept in a ring that grows on demand, a zeroed
+ * queue_t is an empty queue */
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
+	struct pcb_t ** proc;
+	int head;	// Index of the front process
 	int size;
+	int cap;	// Slots in [proc]
 };
 
 void enqueue(struct queue_t * q, struct pcb_t * proc);
@@ -17,6 +17,7 @@
 struct timer_id_t {
 	int done;
 	int fsh;
+	uint32_t skip; // Number of upcoming slots the device sleeps through
 	pthread_cond_t event_cond;
 	pthread_mutex_t event_lock;
 	pthread_cond_t timer_cond;
@@ -33,6 +34,9 @@ void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
+/* Finish the current slot and sleep through the next [n - 1] ones */
+void next_slots(struct timer_id_t* timer_id, uint32_t n);
+
 uint64_t current_time();
 
 #endif
@@ -2,6 +2,13 @@
 #include "cpu.h"
 #include "mem.h"
 #include "mm.h"
+#include "perf.h"
+#include "iodev.h"
+#include "prof.h"
+#include "loader.h"
+#include "sched.h"
+#include "timer.h"
+#include <stdlib.h>
 #ifdef IODUMP
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,6 +57,53 @@ int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
+#ifdef MM_PAGING
+int fork_proc(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t reg_index) { // Register receiving the child PID, 0 in the child
+	if (reg_index >= NUM_REGS) {
+		return 1;
+	}
+	struct pcb_t * child = clone_pcb(proc);
+	if (__fork(proc, child) < 0) {
+		free_pcb(child);
+		return 1;
+	}
+	proc->regs[reg_index] = child->pid;
+	child->regs[reg_index] = 0;
+#ifdef IODUMP
+	printf(ANSI_COLOR_PINK "Process %d fork child %d\n" ANSI_COLOR_RESET, proc->pid, child->pid);
+#endif
+#ifdef PERFCTR
+	child->perf.ready_since = current_time();
+#endif
+	add_proc(child);
+	return 0;
+}
+
+int thread_proc(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t reg_index) { // Register receiving the thread PID, 0 in the thread
+	if (reg_index >= NUM_REGS) {
+		return 1;
+	}
+	/* The thread runs the same code on the same memory, only the
+	 * registers and the program counter are its own */
+	struct pcb_t * thread = clone_pcb(proc);
+	__clone_vm(proc, thread);
+	proc->regs[reg_index] = thread->pid;
+	thread->regs[reg_index] = 0;
+#ifdef IODUMP
+	printf(ANSI_COLOR_PINK "Process %d start thread %d\n" ANSI_COLOR_RESET, proc->pid, thread->pid);
+#endif
+#ifdef PERFCTR
+	thread->perf.ready_since = current_time();
+#endif
+	add_proc(thread);
+	return 0;
+}
+#endif
+
 int run(struct pcb_t * proc) {
 	#ifdef IODUMP
 	// char* inst = malloc(INST_MAX_SIZE * sizeof(char));
@@ -59,12 +113,25 @@ int run(struct pcb_t * proc) {
 		return 1;
 	}
 	
-	struct inst_t ins = proc->code->text[proc->pc];
+	struct inst_t ins;
+	code_fetch(proc->code, proc->pc, &ins);
 	proc->pc++;
+	PERF_INC(proc, ins_retired[ins.opcode]);
+#ifdef PROFILE
+	uint32_t at = proc->pc - 1;
+	uint64_t fault = proc->perf.pgfault;
+	uint64_t swap = proc->perf.swapin + proc->perf.swapout;
+#endif
 	int stat = 1;
 	switch (ins.opcode) {
 	case CALC:
 		stat = calc(proc);
+		/* Stay on a counted CALC until its whole run has retired */
+		if (++proc->pc_rep < ins.arg_0) {
+			proc->pc--;
+		}else{
+			proc->pc_rep = 0;
+		}
 		break;
 	case ALLOC:
 #ifdef MM_PAGING
@@ -129,11 +196,100 @@ MEMPHY_dump(proc->mram);
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 #endif
 		break;
+#ifdef MM_PAGING
+	case FILL:
+		stat = pgfill(proc, ins.arg_0, ins.arg_1, ins.arg_2, ins.arg_3);
+#ifdef IODUMP
+		MEMPHY_dump(proc->mram);
+#endif
+		break;
+	case COPY:
+		stat = pgcopy(proc, ins.arg_0, ins.arg_1, ins.arg_2, ins.arg_3, ins.arg_4);
+#ifdef IODUMP
+		MEMPHY_dump(proc->mram);
+#endif
+		break;
+	case LOAD32:
+		stat = pgload(proc, ins.arg_0, ins.arg_1, ins.arg_2, 4);
+		break;
+	case LOAD64:
+		stat = pgload(proc, ins.arg_0, ins.arg_1, ins.arg_2, 8);
+		break;
+	case STORE32:
+		stat = pgstore(proc, ins.arg_0, ins.arg_1, ins.arg_2, 4);
+#ifdef IODUMP
+		MEMPHY_dump(proc->mram);
+#endif
+		break;
+	case STORE64:
+		stat = pgstore(proc, ins.arg_0, ins.arg_1, ins.arg_2, 8);
+#ifdef IODUMP
+		MEMPHY_dump(proc->mram);
+#endif
+		break;
+#endif
+	case IO:
+		stat = io_submit(proc, ins.arg_0);
+		break;
+	case SLEEP:
+		stat = io_sleep(proc, ins.arg_0);
+		break;
+	case YIELD:
+		proc->state = PROC_YIELDED;
+		stat = 0;
+		break;
+#ifdef MM_PAGING
+	case FORK:
+		stat = fork_proc(proc, ins.arg_0);
+		break;
+	case SHMGET:
+		stat = pgshmget(proc, ins.arg_0, ins.arg_1);
+		break;
+	case SHMAT:
+		stat = pgshmat(proc, ins.arg_0, ins.arg_1);
+		break;
+	case THREAD:
+		stat = thread_proc(proc, ins.arg_0);
+		break;
+	case SEND:
+		stat = pgsend(proc, ins.arg_0, ins.arg_1);
+		break;
+	case RECV:
+		stat = pgrecv(proc, ins.arg_0, ins.arg_1);
+		break;
+#endif
 	default:
 		stat = 1;
 	}
+	PROF_ADD(proc, at, exec, 1);
+	PROF_ADD(proc, at, slot, 1);
+	PROF_ADD(proc, at, fault, proc->perf.pgfault - fault);
+	PROF_ADD(proc, at, swap, proc->perf.swapin + proc->perf.swapout - swap);
 	return stat;
 
 }
 
+uint32_t run_calc(struct pcb_t * proc, uint32_t budget) {
+	if (proc->pc >= proc->code->size || budget == 0) {
+		return 0;
+	}
+	const struct code_ins_t * ins = &proc->code->text[proc->pc];
+	if (ins->opcode != CALC) {
+		return 0;
+	}
+	/* calc() has no side effect, so retiring n of them at once is
+	 * the same as running them one slot at a time */
+	uint32_t left = ins->arg32 - proc->pc_rep;
+	uint32_t n = (left < budget) ? left : budget;
+	PERF_ADD(proc, ins_retired[CALC], n);
+	PROF_ADD(proc, proc->pc, exec, n);
+	PROF_ADD(proc, proc->pc, slot, n);
+	if (n == left) {
+		proc->pc++;
+		proc->pc_rep = 0;
+	}else{
+		proc->pc_rep += n;
+	}
+	return n;
+}
 
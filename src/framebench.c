@@ -0,0 +1,128 @@
+#include "common.h"
+#include "mm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Frame allocator scalability benchmark. Each CPU thread takes a burst
+ * of frames from one RAM and gives them back, over and over, first
+ * with every frame going through the device lock and then with the
+ * per-CPU magazines, for 1, 2, 4, ... CPUs */
+
+/* MEMPHY_dump() takes it, the simulator defines it in mm.c */
+pthread_mutex_t MEM_in_use = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	uint32_t cpus;	// Most CPUs to run with
+	uint32_t rounds;	// Bursts per CPU
+	uint32_t burst;	// Frames per burst
+	uint32_t ram;
+} fb;
+
+struct fb_cpu_t {
+	pthread_t thread;
+	int id;
+	int mag;	// Run as a CPU with a magazine
+	struct memphy_struct * mram;
+	pthread_barrier_t * start;
+	uint64_t ops;
+};
+
+static void * fb_routine(void * arg) {
+	struct fb_cpu_t * cpu = (struct fb_cpu_t *)arg;
+	int * fpn = (int *)malloc(fb.burst * sizeof(int));
+	uint32_t r, i, n;
+
+	MEMPHY_set_cpu(cpu->mag ? cpu->id : -1);
+	pthread_barrier_wait(cpu->start);
+	for (r = 0; r < fb.rounds; r++) {
+		for (n = 0; n < fb.burst && MEMPHY_get_freefp(cpu->mram, &fpn[n]) == 0; n++)
+			;
+		for (i = 0; i < n; i++) {
+			MEMPHY_put_freefp(cpu->mram, fpn[i]);
+		}
+		cpu->ops += 2 * n;
+	}
+	free(fpn);
+	return NULL;
+}
+
+/* Million frame operations per second of [ncpu] CPUs */
+static double fb_run(uint32_t ncpu, int mag) {
+	struct memphy_struct mram;
+	struct fb_cpu_t * cpu = (struct fb_cpu_t *)calloc(ncpu, sizeof(struct fb_cpu_t));
+	pthread_barrier_t start;
+	struct timespec t0, t1;
+	uint64_t ops = 0;
+	uint32_t i;
+
+	init_memphy(&mram, fb.ram, 1);
+	if (mag) {
+		MEMPHY_mag_init(&mram, ncpu);
+	}
+	pthread_barrier_init(&start, NULL, ncpu + 1);
+	for (i = 0; i < ncpu; i++) {
+		cpu[i].id = i;
+		cpu[i].mag = mag;
+		cpu[i].mram = &mram;
+		cpu[i].start = &start;
+		pthread_create(&cpu[i].thread, NULL, fb_routine, &cpu[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < ncpu; i++) {
+		pthread_join(cpu[i].thread, NULL);
+		ops += cpu[i].ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_barrier_destroy(&start);
+	free(cpu);
+	return ops / ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+}
+
+static void usage(void) {
+	printf("Usage: framebench [options]\n"
+		"\t-c [count]  most CPUs, runs with 1, 2, 4, ... up to it (64)\n"
+		"\t-n [count]  bursts per CPU (20000)\n"
+		"\t-b [count]  frames per burst (8)\n"
+		"\t-r [bytes]  RAM size (16777216)\n");
+}
+
+int main(int argc, char * argv[]) {
+	uint32_t ncpu;
+	int opt;
+
+	fb.cpus = 64;
+	fb.rounds = 20000;
+	fb.burst = 8;
+	fb.ram = 16777216;
+	while ((opt = getopt(argc, argv, "c:n:b:r:")) != -1) {
+		switch (opt) {
+		case 'c': fb.cpus = strtoul(optarg, NULL, 10); break;
+		case 'n': fb.rounds = strtoul(optarg, NULL, 10); break;
+		case 'b': fb.burst = strtoul(optarg, NULL, 10); break;
+		case 'r': fb.ram = strtoul(optarg, NULL, 10); break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (fb.cpus == 0 || fb.burst == 0 || fb.ram < PAGING_PAGESZ) {
+		usage();
+		return 1;
+	}
+
+#ifndef FRAME_MAG
+	printf("FRAME_MAG is not set, both columns take the lock\n");
+#endif
+	printf("%6s %14s %14s %8s\n", "CPUs", "lock Mops/s", "magazine", "speedup");
+	for (ncpu = 1; ncpu <= fb.cpus; ncpu *= 2) {
+		double lock = fb_run(ncpu, 0);
+		double mag = fb_run(ncpu, 1);
+		printf("%6u %14.2f %14.2f %7.2fx\n", ncpu, lock, mag, mag / lock);
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+
+#include "iodev.h"
+#include "sched.h"
+#include "timer.h"
+#include "perf.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct io_req_t {
+	struct pcb_t * proc;
+	uint64_t done_time; // Slot the request completes at
+	struct io_req_t * next;
+};
+
+/* Requests complete in submission order, so the wait queue is a FIFO */
+static struct io_req_t * wait_head = NULL;
+static struct io_req_t * wait_tail = NULL;
+/* Wake-ups are not device requests, they complete at the next slot */
+static struct io_req_t * wake_head = NULL;
+static struct io_req_t * wake_tail = NULL;
+/* Sleepers wake up in slot order, kept in a binary min-heap on the
+ * wake slot, ties broken by arrival */
+struct io_sleep_t {
+	uint64_t wake_time;
+	uint64_t seq;
+	struct pcb_t * proc;
+};
+static struct io_sleep_t * sleep_heap = NULL;
+static int sleep_cnt = 0;
+static int sleep_cap = 0;
+static uint64_t sleep_seq = 0;
+static int nr_pending = 0;
+static uint64_t busy_until = 0; // Slot the device becomes idle at
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int io_submit(struct pcb_t * proc, uint32_t latency) {
+	struct io_req_t * req = (struct io_req_t *)malloc(sizeof(struct io_req_t));
+	uint64_t now = current_time();
+
+	req->proc = proc;
+	req->next = NULL;
+	proc->state = PROC_BLOCKED;
+#ifdef PERFCTR
+	proc->perf.blocked_since = now;
+#endif
+
+	pthread_mutex_lock(&io_lock);
+	/* The device starts on the request once it is done with the older
+	 * ones, and never earlier than the next slot */
+	uint64_t start = (busy_until > now) ? busy_until : now;
+	req->done_time = start + (latency > 0 ? latency : 1);
+	busy_until = req->done_time;
+	if (wait_tail == NULL) {
+		wait_head = req;
+	}else{
+		wait_tail->next = req;
+	}
+	wait_tail = req;
+	nr_pending++;
+	pthread_mutex_unlock(&io_lock);
+
+#ifdef IODUMP
+	printf(ANSI_COLOR_PINK "Process %d I/O request latency=%u done at slot %lu\n" ANSI_COLOR_RESET,
+		proc->pid, latency, (unsigned long)req->done_time);
+#endif
+	return 0;
+}
+
+int io_wakeup(struct pcb_t * proc) {
+	struct io_req_t * req = (struct io_req_t *)malloc(sizeof(struct io_req_t));
+
+	req->proc = proc;
+	req->next = NULL;
+	pthread_mutex_lock(&io_lock);
+	req->done_time = current_time();
+	if (wake_tail == NULL) {
+		wake_head = req;
+	}else{
+		wake_tail->next = req;
+	}
+	wake_tail = req;
+	nr_pending++;
+	pthread_mutex_unlock(&io_lock);
+	return 0;
+}
+
+static int sleep_before(const struct io_sleep_t * a, const struct io_sleep_t * b) {
+	return a->wake_time < b->wake_time
+		|| (a->wake_time == b->wake_time && a->seq < b->seq);
+}
+
+int io_sleep(struct pcb_t * proc, uint32_t slots) {
+	uint64_t now = current_time();
+	struct io_sleep_t ent;
+	int i;
+
+	proc->state = PROC_BLOCKED;
+#ifdef PERFCTR
+	proc->perf.blocked_since = now;
+#endif
+	ent.wake_time = now + (slots > 0 ? slots : 1);
+	ent.proc = proc;
+
+	pthread_mutex_lock(&io_lock);
+	if (sleep_cnt == sleep_cap) {
+		sleep_cap = sleep_cap ? sleep_cap * 2 : 8;
+		sleep_heap = (struct io_sleep_t *)realloc(sleep_heap,
+			sleep_cap * sizeof(struct io_sleep_t));
+	}
+	ent.seq = sleep_seq++;
+	/* Sift up */
+	for (i = sleep_cnt++; i > 0 && sleep_before(&ent, &sleep_heap[(i - 1) / 2]); i = (i - 1) / 2) {
+		sleep_heap[i] = sleep_heap[(i - 1) / 2];
+	}
+	sleep_heap[i] = ent;
+	nr_pending++;
+	pthread_mutex_unlock(&io_lock);
+
+#ifdef IODUMP
+	printf(ANSI_COLOR_PINK "Process %d sleep %u slots, wake at slot %lu\n" ANSI_COLOR_RESET,
+		proc->pid, slots, (unsigned long)ent.wake_time);
+#endif
+	return 0;
+}
+
+/* Remove the earliest sleeper, io_lock held */
+static struct pcb_t * sleep_pop(void) {
+	struct pcb_t * proc = sleep_heap[0].proc;
+	struct io_sleep_t last = sleep_heap[--sleep_cnt];
+	int i = 0, c;
+
+	/* Sift down */
+	while ((c = 2 * i + 1) < sleep_cnt) {
+		if (c + 1 < sleep_cnt && sleep_before(&sleep_heap[c + 1], &sleep_heap[c])) {
+			c++;
+		}
+		if (!sleep_before(&sleep_heap[c], &last)) {
+			break;
+		}
+		sleep_heap[i] = sleep_heap[c];
+		i = c;
+	}
+	sleep_heap[i] = last;
+	return proc;
+}
+
+static void io_ready(struct pcb_t * proc, uint64_t now) {
+	/* The process is off every CPU, so updating it here is safe */
+	PERF_ADD(proc, slot_blocked, now - proc->perf.blocked_since);
+	proc->state = PROC_RUNNABLE;
+#ifdef PERFCTR
+	proc->perf.ready_since = now;
+#endif
+	add_proc(proc);
+}
+
+int io_complete(uint64_t now) {
+	int count = 0;
+	pthread_mutex_lock(&io_lock);
+	/* A wake-up of slot [now] may be for a process still on its CPU,
+	 * it is only off it once that slot is over. Wake-ups are stamped
+	 * under io_lock, so the list is in slot order */
+	while (wake_head != NULL && wake_head->done_time < now) {
+		struct io_req_t * req = wake_head;
+		wake_head = req->next;
+		if (wake_head == NULL) {
+			wake_tail = NULL;
+		}
+		nr_pending--;
+		printf(ANSI_COLOR_CYAN "\tProcess %2d woken up" ANSI_COLOR_RESET "\n",
+			req->proc->pid);
+		io_ready(req->proc, now);
+		free(req);
+		count++;
+	}
+	while (sleep_cnt > 0 && sleep_heap[0].wake_time <= now) {
+		struct pcb_t * proc = sleep_pop();
+		nr_pending--;
+		printf(ANSI_COLOR_CYAN "\tProcess %2d woken up" ANSI_COLOR_RESET "\n",
+			proc->pid);
+		io_ready(proc, now);
+		count++;
+	}
+	while (wait_head != NULL && wait_head->done_time <= now) {
+		struct io_req_t * req = wait_head;
+		wait_head = req->next;
+		if (wait_head == NULL) {
+			wait_tail = NULL;
+		}
+		nr_pending--;
+		printf(ANSI_COLOR_CYAN "\tI/O device: Process %2d request completed" ANSI_COLOR_RESET "\n",
+			req->proc->pid);
+		io_ready(req->proc, now);
+		free(req);
+		count++;
+	}
+	pthread_mutex_unlock(&io_lock);
+	return count;
+}
+
+int io_pending(void) {
+	pthread_mutex_lock(&io_lock);
+	int n = nr_pending;
+	pthread_mutex_unlock(&io_lock);
+	return n;
+}
+
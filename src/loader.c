@@ -1,8 +1,11 @@
 
 #include "loader.h"
+#include "parse.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 static uint32_t avail_pid = 1;
 
@@ -11,97 +14,550 @@ static uint32_t avail_pid = 1;
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_IO		"io"
+#define OPT_SLEEP	"sleep"
+#define OPT_YIELD	"yield"
 #ifdef MM_PAGING
 #define OPT_MALLOC	"malloc"
+#define OPT_FILL	"fill"
+#define OPT_COPY	"copy"
+#define OPT_LOAD32	"load32"
+#define OPT_STORE32	"store32"
+#define OPT_LOAD64	"load64"
+#define OPT_STORE64	"store64"
+#define OPT_FORK	"fork"
+#define OPT_SHMGET	"shmget"
+#define OPT_SHMAT	"shmat"
+#define OPT_THREAD	"thread"
+#define OPT_SEND	"send"
+#define OPT_RECV	"recv"
 #endif
 
-static enum ins_opcode_t get_opcode(char * opt) {
-	if (!strcmp(opt, OPT_CALC)) {
-		return CALC;
-	}else if (!strcmp(opt, OPT_ALLOC)) {
-		return ALLOC;
+#define OPT_IS(opt)	(len == sizeof(opt) - 1 && !memcmp(word, opt, len))
+
+/* Opcode named by a word of the program text, -1 if there is none.
+ * The first byte narrows it down to a few names of known length */
+static int get_opcode(const char * word, uint32_t len) {
+	switch (word[0]) {
+	case 'a':
+		if (OPT_IS(OPT_ALLOC)) return ALLOC;
+		break;
+	case 'c':
+		if (OPT_IS(OPT_CALC)) return CALC;
+#ifdef MM_PAGING
+		if (OPT_IS(OPT_COPY)) return COPY;
+#endif
+		break;
+	case 'f':
+		if (OPT_IS(OPT_FREE)) return FREE;
+#ifdef MM_PAGING
+		if (OPT_IS(OPT_FILL)) return FILL;
+		if (OPT_IS(OPT_FORK)) return FORK;
+#endif
+		break;
+	case 'i':
+		if (OPT_IS(OPT_IO)) return IO;
+		break;
+#ifdef MM_PAGING
+	case 'l':
+		if (OPT_IS(OPT_LOAD32)) return LOAD32;
+		if (OPT_IS(OPT_LOAD64)) return LOAD64;
+		break;
+	case 'm':
+		if (OPT_IS(OPT_MALLOC)) return MALLOC;
+		break;
+#endif
+	case 'r':
+		if (OPT_IS(OPT_READ)) return READ;
+#ifdef MM_PAGING
+		if (OPT_IS(OPT_RECV)) return RECV;
+#endif
+		break;
+	case 's':
+		if (OPT_IS(OPT_SLEEP)) return SLEEP;
 #ifdef MM_PAGING
-	}else if (!strcmp(opt, OPT_MALLOC)) {
-		return MALLOC;
-#endif
-	}else if (!strcmp(opt, OPT_FREE)) {
-		return FREE;
-	}else if (!strcmp(opt, OPT_READ)) {
-		return READ;
-	}else if (!strcmp(opt, OPT_WRITE)) {
-		return WRITE;
+		if (OPT_IS(OPT_STORE32)) return STORE32;
+		if (OPT_IS(OPT_STORE64)) return STORE64;
+		if (OPT_IS(OPT_SHMGET)) return SHMGET;
+		if (OPT_IS(OPT_SHMAT)) return SHMAT;
+		if (OPT_IS(OPT_SEND)) return SEND;
+#endif
+		break;
+#ifdef MM_PAGING
+	case 't':
+		if (OPT_IS(OPT_THREAD)) return THREAD;
+		break;
+#endif
+	case 'w':
+		if (OPT_IS(OPT_WRITE)) return WRITE;
+		break;
+	case 'y':
+		if (OPT_IS(OPT_YIELD)) return YIELD;
+		break;
+	}
+	return -1;
+}
+
+/* Number of arguments of each opcode in the program text. A CALC has
+ * none in the text, its run length is counted by the loader */
+static const uint8_t op_nargs[NUM_OPCODES] = {
+	[CALC] = 0,
+	[ALLOC] = 2,
+	[FREE] = 1,
+	[READ] = 3,
+	[WRITE] = 3,
+	[IO] = 1,
+	[SLEEP] = 1,
+	[YIELD] = 0,
+#ifdef MM_PAGING
+	[MALLOC] = 2,
+	[FILL] = 4,
+	[COPY] = 5,
+	[LOAD32] = 3,
+	[STORE32] = 3,
+	[LOAD64] = 3,
+	[STORE64] = 3,
+	[FORK] = 1,
+	[SHMGET] = 2,
+	[SHMAT] = 2,
+	[THREAD] = 1,
+	[SEND] = 2,
+	[RECV] = 2,
+#endif
+};
+
+/* Code segment under construction */
+struct code_buf_t {
+	struct code_ins_t * text;
+	uint32_t * pool;
+	uint32_t * line;
+	uint32_t size, cap;
+	uint32_t npool, poolcap;
+};
+
+/* Append an instruction, its arguments go inline when they fit */
+static void code_emit(struct code_buf_t * buf, enum ins_opcode_t opcode,
+		const uint32_t * args, uint32_t nargs, uint32_t line) {
+	struct code_ins_t * ins;
+	if (buf->size == buf->cap) {
+		buf->cap = buf->cap ? buf->cap * 2 : 16;
+		buf->text = (struct code_ins_t *)realloc(buf->text, buf->cap * sizeof(struct code_ins_t));
+		buf->line = (uint32_t *)realloc(buf->line, buf->cap * sizeof(uint32_t));
+	}
+	ins = &buf->text[buf->size];
+	buf->line[buf->size] = line;
+	buf->size++;
+
+	ins->opcode = opcode;
+	ins->flags = nargs;
+	ins->arg16 = 0;
+	ins->arg32 = 0;
+	if (nargs == 1) {
+		ins->arg32 = args[0];
+	}else if (nargs == 2 && args[0] <= 0xffff) {
+		ins->arg16 = args[0];
+		ins->arg32 = args[1];
+	}else if (nargs > 0) {
+		uint32_t i;
+		while (buf->npool + nargs > buf->poolcap) {
+			buf->poolcap = buf->poolcap ? buf->poolcap * 2 : 16;
+			buf->pool = (uint32_t *)realloc(buf->pool, buf->poolcap * sizeof(uint32_t));
+		}
+		ins->flags |= CODE_POOL;
+		ins->arg32 = buf->npool;
+		for (i = 0; i < nargs; i++) {
+			buf->pool[buf->npool++] = args[i];
+		}
+	}
+}
+
+/* Parse a program text. Consecutive CALCs are collapsed into a single
+ * counted CALC, so the code segment may end up shorter than the text */
+static int parse_code(struct parse_t * ps, uint32_t * priority, struct code_buf_t * buf) {
+	const char * word;
+	uint32_t len, nlines, i, k;
+	uint32_t args[5];
+	uint32_t calc = 0, calc_line = 0;
+
+	memset(buf, 0, sizeof(*buf));
+	if (parse_u32(ps, priority, "priority") < 0
+			|| parse_u32(ps, &nlines, "instruction count") < 0) {
+		return -1;
+	}
+	/* Every instruction takes at least two bytes of text */
+	buf->cap = (nlines < (ps->end - ps->p) / 2) ? nlines : (ps->end - ps->p) / 2;
+	if (buf->cap > 0) {
+		buf->text = (struct code_ins_t *)malloc(buf->cap * sizeof(struct code_ins_t));
+		buf->line = (uint32_t *)malloc(buf->cap * sizeof(uint32_t));
+	}
+	for (i = 0; i < nlines; i++) {
+		if (parse_word(ps, &word, &len, "opcode") < 0) {
+			goto fail;
+		}
+		int op = get_opcode(word, len);
+		if (op < 0) {
+			parse_error(ps, "unknown opcode '%.*s'", (int)len, word);
+			goto fail;
+		}
+		if (op == CALC) {
+			if (calc++ == 0) {
+				calc_line = ps->line;
+			}
+			continue;
+		}
+		if (calc > 0) {
+			code_emit(buf, CALC, &calc, 1, calc_line);
+			calc = 0;
+		}
+		for (k = 0; k < op_nargs[op]; k++) {
+			if (parse_u32(ps, &args[k], "argument") < 0) {
+				goto fail;
+			}
+		}
+		code_emit(buf, op, args, op_nargs[op], ps->line);
+	}
+	if (calc > 0) {
+		code_emit(buf, CALC, &calc, 1, calc_line);
+	}
+	return 0;
+fail:
+	free(buf->text);
+	free(buf->pool);
+	free(buf->line);
+	return -1;
+}
+
+/* FNV-1a over the sections that follow the header */
+static uint32_t code_checksum(const void * data, size_t len) {
+	const uint8_t * p = (const uint8_t *)data;
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static int bad_binary(const char * path, const char * why) {
+	printf("Invalid program binary at '%s': %s\n", path, why);
+	return -1;
+}
+
+/* Point a code segment into the image of a compiled program */
+static int map_code(struct code_seg_t * code, uint32_t * priority) {
+	const struct prog_hdr_t * hdr = (const struct prog_hdr_t *)code->image;
+	size_t body;
+	uint32_t i;
+
+	if (code->image_size < sizeof(struct prog_hdr_t)) {
+		return bad_binary(code->path, "truncated header");
+	}
+	if (hdr->version != PROG_VERSION) {
+		return bad_binary(code->path, "unsupported version");
+	}
+	if (hdr->nopcodes != NUM_OPCODES) {
+		return bad_binary(code->path, "compiled for another opcode set");
+	}
+	body = (size_t)hdr->size * sizeof(struct code_ins_t) + (size_t)hdr->npool * sizeof(uint32_t);
+	if (hdr->flags & PROG_LINES) {
+		body += (size_t)hdr->size * sizeof(uint32_t);
+	}
+	if (code->image_size < sizeof(struct prog_hdr_t) + body) {
+		return bad_binary(code->path, "truncated code");
+	}
+	if (code_checksum(hdr + 1, body) != hdr->checksum) {
+		return bad_binary(code->path, "checksum mismatch");
+	}
+
+	code->text = (const struct code_ins_t *)(hdr + 1);
+	code->pool = (const uint32_t *)(code->text + hdr->size);
+	/* The checksum only catches accidents, every instruction is checked
+	 * once here so code_fetch() and the CPU can trust the text */
+	for (i = 0; i < hdr->size; i++) {
+		const struct code_ins_t * c = &code->text[i];
+		uint32_t nargs = c->flags & CODE_NARGS;
+
+		if (c->opcode >= NUM_OPCODES) {
+			return bad_binary(code->path, "unknown opcode");
+		}
+		if (c->flags & ~(CODE_NARGS | CODE_POOL)
+				|| nargs != (c->opcode == CALC ? 1 : op_nargs[c->opcode])) {
+			return bad_binary(code->path, "bad argument count");
+		}
+		if (c->flags & CODE_POOL) {
+			if (nargs > hdr->npool || c->arg32 > hdr->npool - nargs) {
+				return bad_binary(code->path, "operand pool index out of range");
+			}
+		}else if (nargs > 2) {
+			return bad_binary(code->path, "bad argument count");
+		}
+	}
+	code->size = hdr->size;
+#ifdef PROFILE
+	code->line = (hdr->flags & PROG_LINES) ? code->pool + hdr->npool : NULL;
+#endif
+	*priority = hdr->priority;
+	return 0;
+}
+
+/* Code segments are immutable once loaded, so every process running the
+ * same program shares one. They are interned by path and file version,
+ * a program rewritten between two loads gets a segment of its own */
+static struct code_seg_t * code_list = NULL;
+static pthread_mutex_t code_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct code_seg_t * load_code(const char * path, uint32_t * priority) {
+	struct code_seg_t * code;
+	struct parse_t ps;
+	int err = 0;
+
+	if (parse_open(&ps, path) < 0) {
+		printf("Cannot find process description at '%s'\n", path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&code_lock);
+	for (code = code_list; code != NULL; code = code->next) {
+		if (ps.version != 0 && code->version == ps.version
+				&& !strcmp(code->path, path)) {
+			break;
+		}
+	}
+	if (code != NULL) {
+		code->refs++;
+		*priority = code->priority;
+		pthread_mutex_unlock(&code_lock);
+		parse_close(&ps);
+		return code;
+	}
+
+	code = (struct code_seg_t *)calloc(1, sizeof(struct code_seg_t));
+	code->path = strdup(path);
+	code->version = ps.version;
+	code->refs = 1;
+	/* A compiled program needs no parsing, its image is the segment */
+	if (ps.size >= sizeof(((struct prog_hdr_t *)0)->magic)
+			&& !memcmp(ps.image, PROG_MAGIC, sizeof(((struct prog_hdr_t *)0)->magic))) {
+		code->image = ps.image;
+		code->image_size = ps.size;
+		if ((err = map_code(code, &code->priority)) < 0) {
+			parse_close(&ps);
+		}
 	}else{
-		printf("Opcode: %s\n", opt);
-		exit(1);
+		struct code_buf_t buf;
+		if ((err = parse_code(&ps, &code->priority, &buf)) == 0) {
+			code->text = buf.text;
+			code->pool = buf.pool;
+			code->size = buf.size;
+#ifdef PROFILE
+			code->line = buf.line;
+#else
+			free(buf.line);
+#endif
+		}
+		parse_close(&ps);
+	}
+	if (err < 0) {
+		pthread_mutex_unlock(&code_lock);
+		free(code->path);
+		free(code);
+		return NULL;
 	}
+	code->next = code_list;
+	code_list = code;
+	*priority = code->priority;
+	pthread_mutex_unlock(&code_lock);
+	return code;
 }
 
-struct pcb_t * load(const char * path) {
+void put_code(struct code_seg_t * code) {
+	struct code_seg_t ** it;
+
+	pthread_mutex_lock(&code_lock);
+	if (__sync_sub_and_fetch(&code->refs, 1) > 0) {
+		pthread_mutex_unlock(&code_lock);
+		return;
+	}
+	for (it = &code_list; *it != NULL; it = &(*it)->next) {
+		if (*it == code) {
+			*it = code->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&code_lock);
+
+	if (code->image != NULL) {
+		munmap(code->image, code->image_size);
+	}else{
+		free((void *)code->text);
+		free((void *)code->pool);
+#ifdef PROFILE
+		free((void *)code->line);
+#endif
+	}
+	free(code->path);
+	free(code);
+}
+
+int compile_code(const char * src, const char * dst) {
+	struct prog_hdr_t hdr;
+	struct code_buf_t buf;
+	struct parse_t ps;
+	FILE * out;
+	uint8_t * body;
+	size_t ntext, npool, nline;
+
+	if (parse_open(&ps, src) < 0) {
+		printf("Cannot find process description at '%s'\n", src);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	if (parse_code(&ps, &hdr.priority, &buf) < 0) {
+		parse_close(&ps);
+		return -1;
+	}
+	parse_close(&ps);
+
+	memcpy(hdr.magic, PROG_MAGIC, sizeof(hdr.magic));
+	hdr.version = PROG_VERSION;
+	hdr.nopcodes = NUM_OPCODES;
+	hdr.size = buf.size;
+	hdr.npool = buf.npool;
+	hdr.flags = PROG_LINES;
+
+	/* The checksum covers the sections in file order */
+	ntext = buf.size * sizeof(struct code_ins_t);
+	npool = buf.npool * sizeof(uint32_t);
+	nline = buf.size * sizeof(uint32_t);
+	body = (uint8_t *)malloc(ntext + npool + nline + 1);
+	memcpy(body, buf.text, ntext);
+	memcpy(body + ntext, buf.pool, npool);
+	memcpy(body + ntext + npool, buf.line, nline);
+	hdr.checksum = code_checksum(body, ntext + npool + nline);
+
+	if ((out = fopen(dst, "wb")) == NULL) {
+		printf("Cannot write program binary to '%s'\n", dst);
+		free(body);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(body, 1, ntext + npool + nline, out);
+	fclose(out);
+	free(body);
+	free(buf.text);
+	free(buf.pool);
+	free(buf.line);
+	return 0;
+}
+
+/* PCBs are carved out of cache line aligned slabs of PCB_SLAB and
+ * recycled through a free list, which is linked through their first
+ * bytes. Slabs are kept until the simulation ends */
+#define PCB_SLAB	64
+
+static struct pcb_t * pcb_free_list = NULL;
+static pthread_mutex_t pcb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pcb_t * alloc_pcb(void) {
+	struct pcb_t * proc;
+	int i;
+
+	pthread_mutex_lock(&pcb_lock);
+	if (pcb_free_list == NULL) {
+		struct pcb_t * slab = (struct pcb_t *)aligned_alloc(PCB_ALIGN,
+			PCB_SLAB * sizeof(struct pcb_t));
+		if (slab == NULL) {
+			printf("Out of memory for PCBs\n");
+			exit(1);
+		}
+		for (i = PCB_SLAB - 1; i >= 0; i--) {
+			*(struct pcb_t **)&slab[i] = pcb_free_list;
+			pcb_free_list = &slab[i];
+		}
+	}
+	proc = pcb_free_list;
+	pcb_free_list = *(struct pcb_t **)proc;
+	pthread_mutex_unlock(&pcb_lock);
+	return proc;
+}
+
+void free_pcb(struct pcb_t * proc) {
+	put_code(proc->code);
+#ifndef MM_PAGING
+	free(proc->page_table);
+#endif
+#ifdef PROFILE
+	free(proc->prof);
+#endif
+	pthread_mutex_lock(&pcb_lock);
+	*(struct pcb_t **)proc = pcb_free_list;
+	pcb_free_list = proc;
+	pthread_mutex_unlock(&pcb_lock);
+}
+
+struct pcb_t * load_pcb(const char * path) {
+	uint32_t priority;
+	struct code_seg_t * code = load_code(path, &priority);
+	if (code == NULL) {
+		return NULL;
+	}
 	/* Create new PCB for the new process */
-	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	struct pcb_t * proc = alloc_pcb();
+	proc->code = code;
+	proc->priority = priority;
+	proc->pid = 0;
+#ifndef MM_PAGING
 	proc->page_table =
 		(struct page_table_t*)malloc(sizeof(struct page_table_t));
 	proc->bp = PAGE_SIZE;
+#endif
 	proc->pc = 0;
+	proc->pc_rep = 0;
+	proc->state = PROC_RUNNABLE;
+	memset(proc->regs, 0, sizeof(proc->regs));
+#ifdef PERFCTR
+	memset(&proc->perf, 0, sizeof(proc->perf));
+#endif
+#ifdef PROFILE
+	proc->prof = (struct prof_ent_t *)calloc(proc->code->size, sizeof(struct prof_ent_t));
+#endif
+	return proc;
+}
 
-	/* Read process code from file */
-	FILE * file;
-	if ((file = fopen(path, "r")) == NULL) {
-		printf("Cannot find process description at '%s'\n", path);
-		exit(1);		
-	}
-	char opcode[10];
-	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
-	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
-	proc->code->text = (struct inst_t*)malloc(
-		sizeof(struct inst_t) * proc->code->size
-	);
-	uint32_t i = 0;
-	for (i = 0; i < proc->code->size; i++) {
-		fscanf(file, "%s", opcode);
-		proc->code->text[i].opcode = get_opcode(opcode);
-		switch(proc->code->text[i].opcode) {
-		case CALC:
-			break;
-		case ALLOC:
-			fscanf(
-				file,
-				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
-			);
-			break;
-#ifdef MM_PAGING
-		case MALLOC:
-			fscanf(
-				file,
-				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
-			);
-#endif
-		case FREE:
-			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
-			break;
-		case READ:
-		case WRITE:
-			fscanf(
-				file,
-				"%u %u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1,
-				&proc->code->text[i].arg_2
-			);
-			break;	
-		default:
-			printf("Opcode: %s\n", opcode);
-			exit(1);
-		}
+void assign_pid(struct pcb_t * proc) {
+	proc->pid = __sync_fetch_and_add(&avail_pid, 1);
+}
+
+struct pcb_t * load(const char * path) {
+	struct pcb_t * proc = load_pcb(path);
+	if (proc != NULL) {
+		assign_pid(proc);
 	}
 	return proc;
 }
 
+struct pcb_t * clone_pcb(const struct pcb_t * parent) {
+	struct pcb_t * proc = alloc_pcb();
+	/* The child resumes right after the instruction that cloned it */
+	*proc = *parent;
+	proc->pid = __sync_fetch_and_add(&avail_pid, 1);
+#ifndef MM_PAGING
+	proc->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+#endif
+	proc->pc_rep = 0;
+	proc->state = PROC_RUNNABLE;
+	__sync_fetch_and_add(&proc->code->refs, 1);
+#ifdef PERFCTR
+	memset(&proc->perf, 0, sizeof(proc->perf));
+#endif
+#ifdef PROFILE
+	proc->prof = (struct prof_ent_t *)calloc(proc->code->size, sizeof(struct prof_ent_t));
+#endif
+	return proc;
+}
 
+uint32_t proc_count(void) {
+	return __sync_fetch_and_add(&avail_pid, 0) - 1;
+}
 
@@ -23,6 +23,7 @@ void init_mem(void) {
 	pthread_mutex_init(&mem_lock, NULL);
 }
 
+#ifndef MM_PAGING
 /* get offset of the virtual address */
 static addr_t get_offset(addr_t addr) {
 	return addr & ~((~0U) << OFFSET_LEN);
@@ -85,15 +86,22 @@ static int translate(
 	}
 	return 0;	
 }
+#else
+/* Paging PCBs have no legacy page table */
+static int translate(addr_t virtual_addr, addr_t * physical_addr, struct pcb_t * proc) {
+	return 0;
+}
+#endif
 
 addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 	pthread_mutex_lock(&mem_lock);
 	addr_t ret_mem = 0;
 	/* DO NOTHING HERE. This mem is obsoleted */
 
+#ifndef MM_PAGING
+	int mem_avail = 0; // We could allocate new memory region or not?
 	uint32_t num_pages = (size % PAGE_SIZE) ? size / PAGE_SIZE :
 		size / PAGE_SIZE + 1; // Number of pages we will use
-	int mem_avail = 0; // We could allocate new memory region or not?
 
 	/* First we must check if the amount of free memory in
 	 * virtual address space and physical address space is
@@ -115,6 +123,7 @@ addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 		 * 	  to ensure accesses to allocated memory slot is
 		 * 	  valid. */
 	}
+#endif
 	pthread_mutex_unlock(&mem_lock);
 	return ret_mem;
 }
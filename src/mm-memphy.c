@@ -7,6 +7,11 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
@@ -17,23 +22,89 @@
 #define ANSI_COLOR_PINK  "\x1b[38;5;225m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
+/* Storage is reserved up front but committed a chunk at a time, on
+ * the first write to the chunk. A chunk never written reads as zero */
+#define MEMPHY_CHUNK_SHIFT 16
+#define MEMPHY_CHUNK       (1 << MEMPHY_CHUNK_SHIFT)
+
+static inline int memphy_live(struct memphy_struct *mp, int addr)
+{
+   int c = addr >> MEMPHY_CHUNK_SHIFT;
+
+   return mp->chunk_map == NULL || ((mp->chunk_map[c / 64] >> (c % 64)) & 1);
+}
+
+/* Bytes from [addr] to the end of its chunk, at most [len] */
+static inline int memphy_span(int addr, int len)
+{
+   int n = MEMPHY_CHUNK - (addr & (MEMPHY_CHUNK - 1));
+
+   return (n < len) ? n : len;
+}
+
 /*
- *  MEMPHY_mv_csr - move MEMPHY cursor
+ *  memphy_commit - make the chunks of a range writable
+ *  @mp: memphy struct, its mutex held
+ *  @addr: address of the first byte
+ *  @len: number of bytes
+ */
+static int memphy_commit(struct memphy_struct *mp, int addr, int len)
+{
+   int c, last;
+
+   if (mp->chunk_map == NULL || len <= 0)
+     return 0;
+   last = (addr + len - 1) >> MEMPHY_CHUNK_SHIFT;
+   for (c = addr >> MEMPHY_CHUNK_SHIFT; c <= last; c++) {
+      size_t off = (size_t)c << MEMPHY_CHUNK_SHIFT;
+      size_t n = mp->maxsz - off;
+
+      if ((mp->chunk_map[c / 64] >> (c % 64)) & 1)
+        continue;
+      if (n > MEMPHY_CHUNK)
+        n = MEMPHY_CHUNK;
+      if (mprotect(mp->storage + off, n, PROT_READ | PROT_WRITE) < 0) {
+        printf(ANSI_COLOR_RED "ERROR: Cannot commit memory of device %d!\n" ANSI_COLOR_RESET, mp->memphy_id);
+        return -1;
+      }
+      mp->chunk_map[c / 64] |= 1ULL << (c % 64);
+   }
+   return 0;
+}
+
+/* Copy [len] bytes of storage at [addr] to [buf], mp->mutex held */
+static void memphy_copyout(struct memphy_struct *mp, int addr, BYTE *buf, int len)
+{
+   while (len > 0) {
+      int n = memphy_span(addr, len);
+
+      if (memphy_live(mp, addr))
+        memcpy(buf, mp->storage + addr, n);
+      else
+        memset(buf, 0, n);
+      addr += n;
+      buf += n;
+      len -= n;
+   }
+}
+
+/*
+ *  MEMPHY_mv_csr - move MEMPHY cursor, mutex of the device held
  *  @mp: memphy struct
  *  @offset: offset
+ *
+ *  The cursor only moves forward and wraps at the end of the device,
+ *  so walking a block in order costs one step per byte.
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
 {
-   pthread_mutex_lock(&mp->mutex);
    int numstep = 0;
 
-   mp->cursor = 0;
-   while(numstep < offset && numstep < mp->maxsz){
+   while(mp->cursor != offset && numstep < mp->maxsz){
      /* Traverse sequentially */
      mp->cursor = (mp->cursor + 1) % mp->maxsz;
      numstep++;
    }
-   pthread_mutex_unlock(&mp->mutex);
    return 0;
 }
 
@@ -50,12 +121,8 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
      return -1;
    }
 
-   if (!mp->rdmflg) {
-      pthread_mutex_unlock(&mp->mutex);
-     return -1; /* Not compatible mode for sequential read */
-   }
    MEMPHY_mv_csr(mp, addr);
-   *value = (BYTE) mp->storage[addr];
+   *value = memphy_live(mp, addr) ? (BYTE) mp->storage[addr] : 0;
    pthread_mutex_unlock(&mp->mutex);
    return 0;
 }
@@ -68,11 +135,11 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
  */
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value)
 {
-   if (mp == NULL)
+   if (mp == NULL || mp->zram != NULL)
      return -1;
    pthread_mutex_lock(&mp->mutex);
    if (mp->rdmflg)
-      *value = mp->storage[addr];
+      *value = memphy_live(mp, addr) ? mp->storage[addr] : 0;
    else /* Sequential access device */
       return MEMPHY_seq_read(mp, addr, value);
    pthread_mutex_unlock(&mp->mutex);
@@ -92,11 +159,11 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
       pthread_mutex_unlock(&mp->mutex);
      return -1;
    }
-   if (!mp->rdmflg) {
+   MEMPHY_mv_csr(mp, addr);
+   if (memphy_commit(mp, addr, 1) < 0) {
       pthread_mutex_unlock(&mp->mutex);
-     return -1; /* Not compatible mode for sequential read */
+      return -1;
    }
-   MEMPHY_mv_csr(mp, addr);
    mp->storage[addr] = value;
    pthread_mutex_unlock(&mp->mutex);
    return 0;
@@ -110,17 +177,237 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
  */
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
 {
-   if (mp == NULL)
+   if (mp == NULL || mp->zram != NULL)
      return -1;
    pthread_mutex_lock(&mp->mutex);
-   if (mp->rdmflg)
+   if (mp->rdmflg) {
+      if (memphy_commit(mp, addr, 1) < 0) {
+         pthread_mutex_unlock(&mp->mutex);
+         return -1;
+      }
       mp->storage[addr] = data;
+   }
    else /* Sequential access device */
       return MEMPHY_seq_write(mp, addr, data);
    pthread_mutex_unlock(&mp->mutex);
    return 0;
 }
 
+/*
+ *  MEMPHY_read_buf - read a block of bytes from MEMPHY device
+ *  @mp: memphy struct
+ *  @addr: address of the first byte
+ *  @buf: obtained values
+ *  @len: number of bytes
+ */
+int MEMPHY_read_buf(struct memphy_struct * mp, int addr, BYTE *buf, int len)
+{
+   if (mp == NULL || !mp->rdmflg || mp->zram != NULL)
+     return -1; /* Block access needs a random access device */
+   if (addr < 0 || len < 0 || addr + len > mp->maxsz)
+     return -1;
+   pthread_mutex_lock(&mp->mutex);
+   memphy_copyout(mp, addr, buf, len);
+   pthread_mutex_unlock(&mp->mutex);
+   return 0;
+}
+
+/*
+ *  MEMPHY_write_buf - write a block of bytes to MEMPHY device
+ *  @mp: memphy struct
+ *  @addr: address of the first byte
+ *  @buf: written values
+ *  @len: number of bytes
+ */
+int MEMPHY_write_buf(struct memphy_struct * mp, int addr, const BYTE *buf, int len)
+{
+   if (mp == NULL || !mp->rdmflg || mp->zram != NULL)
+     return -1;
+   if (addr < 0 || len < 0 || addr + len > mp->maxsz)
+     return -1;
+   pthread_mutex_lock(&mp->mutex);
+   if (memphy_commit(mp, addr, len) < 0) {
+      pthread_mutex_unlock(&mp->mutex);
+      return -1;
+   }
+   memcpy(mp->storage + addr, buf, len);
+   pthread_mutex_unlock(&mp->mutex);
+   return 0;
+}
+
+/*
+ *  MEMPHY_fill - set a block of bytes of MEMPHY device
+ *  @mp: memphy struct
+ *  @addr: address of the first byte
+ *  @value: written value
+ *  @len: number of bytes
+ */
+int MEMPHY_fill(struct memphy_struct * mp, int addr, BYTE value, int len)
+{
+   if (mp == NULL || !mp->rdmflg || mp->zram != NULL)
+     return -1;
+   if (addr < 0 || len < 0 || addr + len > mp->maxsz)
+     return -1;
+   pthread_mutex_lock(&mp->mutex);
+   while (len > 0) {
+      int n = memphy_span(addr, len);
+
+      /* Zeroing a chunk never written does not commit it */
+      if (value != 0 || memphy_live(mp, addr)) {
+         if (memphy_commit(mp, addr, n) < 0)
+            break;
+         memset(mp->storage + addr, value, n);
+      }
+      addr += n;
+      len -= n;
+   }
+   pthread_mutex_unlock(&mp->mutex);
+   return (len > 0) ? -1 : 0;
+}
+
+/*
+ *  MEMPHY_cp_page - copy a frame from one MEMPHY device to another
+ *  @mpsrc: source memphy
+ *  @srcfpn: source frame
+ *  @mpdst: destination memphy
+ *  @dstfpn: destination frame
+ *  @pagesz: page size
+ *
+ *  Each device is locked once for the whole page, the lower address
+ *  first so two copies in opposite directions cannot deadlock. A
+ *  sequential access device is copied a byte at a time instead.
+ */
+int MEMPHY_cp_page(struct memphy_struct *mpsrc, int srcfpn,
+                   struct memphy_struct *mpdst, int dstfpn, int pagesz)
+{
+   struct memphy_struct *first = mpsrc, *second = mpdst;
+   int srcaddr = srcfpn * pagesz, dstaddr = dstfpn * pagesz;
+   int ret = 0;
+
+   if (mpsrc == NULL || mpdst == NULL)
+     return -1;
+   if (srcaddr < 0 || srcaddr + pagesz > mpsrc->maxsz
+       || dstaddr < 0 || dstaddr + pagesz > mpdst->maxsz)
+     return -1;
+   if (!mpsrc->rdmflg || !mpdst->rdmflg) {
+      /* A sequential access device is walked a byte at a time */
+      int i;
+      for (i = 0; i < pagesz; i++) {
+         BYTE data;
+         if (MEMPHY_read(mpsrc, srcaddr + i, &data) < 0
+             || MEMPHY_write(mpdst, dstaddr + i, data) < 0)
+            return -1;
+      }
+      return 0;
+   }
+
+   if (first > second) {
+      first = mpdst;
+      second = mpsrc;
+   }
+   pthread_mutex_lock(&first->mutex);
+   if (second != first)
+      pthread_mutex_lock(&second->mutex);
+   if (mpsrc->zram != NULL && mpdst->zram != NULL)
+      ret = zram_dup(mpsrc->zram, srcfpn, mpdst->zram, dstfpn);
+   else if (mpdst->zram != NULL)
+      ret = zram_store(mpdst->zram, dstfpn,
+                       memphy_live(mpsrc, srcaddr) ? mpsrc->storage + srcaddr : NULL);
+   else if (mpsrc->zram != NULL)
+      ret = (memphy_commit(mpdst, dstaddr, pagesz) < 0) ? -1
+            : zram_load(mpsrc->zram, srcfpn, mpdst->storage + dstaddr);
+   /* A page lies in one chunk, zero to zero needs no commit */
+   else if (memphy_live(mpsrc, srcaddr) || memphy_live(mpdst, dstaddr)) {
+      if ((ret = memphy_commit(mpdst, dstaddr, pagesz)) == 0)
+         memphy_copyout(mpsrc, srcaddr, mpdst->storage + dstaddr, pagesz);
+   }
+   if (second != first)
+      pthread_mutex_unlock(&second->mutex);
+   pthread_mutex_unlock(&first->mutex);
+   return ret;
+}
+
+/*
+ *  MEMPHY_read_page - read a frame of MEMPHY device into a buffer
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @page: buffer of a page
+ *  @pagesz: page size
+ *
+ *  Unlike MEMPHY_read_buf() it also reads compressed devices.
+ */
+int MEMPHY_read_page(struct memphy_struct *mp, int fpn, BYTE *page, int pagesz)
+{
+   int addr = fpn * pagesz, ret = 0;
+
+   if (mp == NULL || addr < 0 || addr + pagesz > mp->maxsz)
+     return -1;
+   if (!mp->rdmflg) {
+      int i;
+      for (i = 0; i < pagesz && ret == 0; i++)
+         ret = MEMPHY_read(mp, addr + i, &page[i]);
+      return ret;
+   }
+   pthread_mutex_lock(&mp->mutex);
+   if (mp->zram != NULL)
+      ret = zram_load(mp->zram, fpn, page);
+   else
+      memphy_copyout(mp, addr, page, pagesz);
+   pthread_mutex_unlock(&mp->mutex);
+   return ret;
+}
+
+/*
+ *  MEMPHY_write_page - write a buffer to a frame of MEMPHY device
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @page: buffer of a page
+ *  @pagesz: page size
+ */
+int MEMPHY_write_page(struct memphy_struct *mp, int fpn, const BYTE *page, int pagesz)
+{
+   int addr = fpn * pagesz, ret = 0;
+
+   if (mp == NULL || addr < 0 || addr + pagesz > mp->maxsz)
+     return -1;
+   if (!mp->rdmflg) {
+      int i;
+      for (i = 0; i < pagesz && ret == 0; i++)
+         ret = MEMPHY_write(mp, addr + i, page[i]);
+      return ret;
+   }
+   pthread_mutex_lock(&mp->mutex);
+   if (mp->zram != NULL)
+      ret = zram_store(mp->zram, fpn, page);
+   else if ((ret = memphy_commit(mp, addr, pagesz)) == 0)
+      memcpy(mp->storage + addr, page, pagesz);
+   pthread_mutex_unlock(&mp->mutex);
+   return ret;
+}
+
+/*
+ *  MEMPHY_zero_page - check if every byte of a frame is zero
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @pagesz: page size
+ */
+int MEMPHY_zero_page(struct memphy_struct *mp, int fpn, int pagesz)
+{
+   int addr = fpn * pagesz, zero = 1;
+
+   if (mp == NULL || mp->zram != NULL || addr < 0 || addr + pagesz > mp->maxsz)
+     return 0;
+   pthread_mutex_lock(&mp->mutex);
+   if (memphy_live(mp, addr)) {
+      const BYTE *p = mp->storage + addr;
+      /* The frame against itself one byte on, so the vectorized
+       * memcmp of the C library does the scan */
+      zero = (p[0] == 0 && memcmp(p, p + 1, pagesz - 1) == 0);
+   }
+   pthread_mutex_unlock(&mp->mutex);
+   return zero;
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
@@ -130,47 +417,298 @@ int MEMPHY_format(struct memphy_struct *mp, int pagesz)
    pthread_mutex_lock(&mp->mutex);
     /* This setting come with fixed constant PAGESZ */
     int numfp = mp->maxsz / pagesz;
-    struct framephy_struct *newfst, *fst;
-    int iter = 0;
 
     if (numfp <= 0) {
       pthread_mutex_unlock(&mp->mutex);
       return -1;
     }
 
-    /* Init head of free framephy list */ 
-    fst = malloc(sizeof(struct framephy_struct));
-    fst->fpn = iter;
-    mp->free_fp_list = fst;
-
-    /* We have list with first element, fill in the rest num-1 element member*/
-    for (iter = 1; iter < numfp ; iter++)
-    {
-       newfst =  malloc(sizeof(struct framephy_struct));
-       newfst->fpn = iter;
-       newfst->fp_next = NULL;
-       fst->fp_next = newfst;
-       fst = newfst;
-    }
+    /* Zeroed bitmaps have every frame free, so formatting does not
+     * touch them but for the frames past the end of the device */
+    mp->fp_words = (numfp + 63) / 64;
+    mp->fp_bitmap = calloc(mp->fp_words, sizeof(uint64_t));
+    mp->fp_summary = calloc((mp->fp_words + 63) / 64, sizeof(uint64_t));
+    mp->fp_nfree = numfp;
+    mp->fp_hint = 0;
+    if (numfp % 64)
+      mp->fp_bitmap[mp->fp_words - 1] = ~0ULL << (numfp % 64);
    pthread_mutex_unlock(&mp->mutex);
     return 0;
 }
 
+/* Mark frames [fpn, fpn + num) used, they are free and in one word */
+static void memphy_take(struct memphy_struct *mp, int fpn, int num)
+{
+   int w = fpn / 64;
+   uint64_t mask = (num == 64) ? ~0ULL : ((1ULL << num) - 1) << (fpn % 64);
+
+   mp->fp_bitmap[w] |= mask;
+   if (mp->fp_bitmap[w] == ~0ULL)
+      mp->fp_summary[w / 64] |= 1ULL << (w % 64);
+   mp->fp_nfree -= num;
+}
+
+/* Take the lowest free frame, mp->mutex held */
+static int memphy_alloc(struct memphy_struct *mp, int *retfpn)
+{
+   int s, w;
+
+   if (mp->fp_nfree == 0)
+     return -1;
+   for (s = mp->fp_hint; mp->fp_summary[s] == ~0ULL; s++)
+      ;
+   mp->fp_hint = s;
+   w = s * 64 + __builtin_ctzll(~mp->fp_summary[s]);
+   *retfpn = w * 64 + __builtin_ctzll(~mp->fp_bitmap[w]);
+   memphy_take(mp, *retfpn, 1);
+   return 0;
+}
+
+/* Give a frame back to the bitmaps, mp->mutex held */
+static void memphy_release(struct memphy_struct *mp, int fpn)
+{
+   int w = fpn / 64;
+
+   mp->fp_bitmap[w] &= ~(1ULL << (fpn % 64));
+   mp->fp_summary[w / 64] &= ~(1ULL << (w % 64));
+   if (w / 64 < mp->fp_hint)
+      mp->fp_hint = w / 64;
+   mp->fp_nfree++;
+}
+
+#ifdef FRAME_MAG
+/* A magazine caches free frames of a device for one CPU. It is
+ * refilled from or spilled to the bitmaps half a magazine at once.
+ * The frames are [fpn] from [top] to [bottom], modulo FRAME_MAG. The
+ * owning CPU pushes and pops at [bottom] without a lock, other CPUs
+ * steal at [top] with a compare-and-swap once the bitmaps run dry, so
+ * the two only race for the last frame (a Chase-Lev deque) */
+struct memphy_mag_t {
+   long top;      // Oldest frame, only grows
+   long bottom;   // Past the newest frame, written by the owner only
+   int fpn[FRAME_MAG];
+} __attribute__((aligned(64)));
+
+static __thread int memphy_cpu = -1;
+
+static struct memphy_mag_t *memphy_mag(struct memphy_struct *mp)
+{
+   if (mp->mag == NULL || memphy_cpu < 0 || memphy_cpu >= mp->nmag)
+     return NULL;
+   return &mp->mag[memphy_cpu];
+}
+
+/* Frames in a magazine, exact for its owner only */
+static int memphy_mag_count(struct memphy_mag_t *mag)
+{
+   long n = __atomic_load_n(&mag->bottom, __ATOMIC_ACQUIRE)
+            - __atomic_load_n(&mag->top, __ATOMIC_ACQUIRE);
+   return (n > 0) ? (int)n : 0;
+}
+
+/* Add a frame on top of the own magazine, which has room */
+static void memphy_mag_push(struct memphy_mag_t *mag, int fpn)
+{
+   long b = mag->bottom;
+
+   __atomic_store_n(&mag->fpn[b % FRAME_MAG], fpn, __ATOMIC_RELAXED);
+   __atomic_store_n(&mag->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* Take the newest frame of the own magazine */
+static int memphy_mag_pop(struct memphy_mag_t *mag, int *retfpn)
+{
+   long b = mag->bottom - 1, t;
+   int ret = 0;
+
+   __atomic_store_n(&mag->bottom, b, __ATOMIC_SEQ_CST);
+   t = __atomic_load_n(&mag->top, __ATOMIC_SEQ_CST);
+   if (t > b) {
+      /* Empty */
+      __atomic_store_n(&mag->bottom, b + 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+   *retfpn = __atomic_load_n(&mag->fpn[b % FRAME_MAG], __ATOMIC_RELAXED);
+   if (t == b) {
+      /* The last frame, a thief may be taking it too */
+      if (!__atomic_compare_exchange_n(&mag->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+         ret = -1;
+      __atomic_store_n(&mag->bottom, b + 1, __ATOMIC_RELAXED);
+   }
+   return ret;
+}
+
+/* Take the oldest frame of a magazine, of any CPU */
+static int memphy_mag_steal(struct memphy_mag_t *mag, int *retfpn)
+{
+   long t = __atomic_load_n(&mag->top, __ATOMIC_SEQ_CST);
+   long b = __atomic_load_n(&mag->bottom, __ATOMIC_SEQ_CST);
+   int fpn;
+
+   while (t < b) {
+      fpn = __atomic_load_n(&mag->fpn[t % FRAME_MAG], __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n(&mag->top, &t, t + 1, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+         *retfpn = fpn;
+         return 0;
+      }
+      /* [t] now holds the new top */
+      b = __atomic_load_n(&mag->bottom, __ATOMIC_SEQ_CST);
+   }
+   return -1;
+}
+#endif
+
+/*
+ *  MEMPHY_set_cpu - name the CPU the calling thread runs as
+ *  @cpu: CPU id, -1 for a thread of no CPU
+ */
+void MEMPHY_set_cpu(int cpu)
+{
+#ifdef FRAME_MAG
+   memphy_cpu = cpu;
+#else
+   (void)cpu;
+#endif
+}
+
+/*
+ *  MEMPHY_mag_init - give each CPU a magazine of free frames
+ *  @mp: memphy struct
+ *  @ncpu: number of CPUs
+ *
+ *  A single CPU has nobody to contend with, and a device too small to
+ *  spare a quarter of its frames to magazines keeps taking the lock.
+ */
+int MEMPHY_mag_init(struct memphy_struct *mp, int ncpu)
+{
+#ifdef FRAME_MAG
+   if (ncpu < 2 || (long)ncpu * FRAME_MAG * 4 > mp->maxsz / PAGING_PAGESZ)
+     return 0;
+   mp->mag = aligned_alloc(64, ncpu * sizeof(struct memphy_mag_t));
+   if (mp->mag == NULL)
+     return -1;
+   memset(mp->mag, 0, ncpu * sizeof(struct memphy_mag_t));
+   mp->nmag = ncpu;
+#else
+   (void)mp;
+   (void)ncpu;
+#endif
+   return 0;
+}
+
+#ifdef FRAME_MAG
+/* Take a frame from the magazine of another CPU, the bitmaps are empty */
+static int memphy_steal(struct memphy_struct *mp, struct memphy_mag_t *own, int *retfpn)
+{
+   int i;
+
+   for (i = 0; i < mp->nmag; i++) {
+      if (&mp->mag[i] != own && memphy_mag_steal(&mp->mag[i], retfpn) == 0)
+         return 0;
+   }
+   return -1;
+}
+#endif
+
+/*
+ *  MEMPHY_get_freefp - take a free frame
+ *  @mp: memphy struct
+ *  @retfpn: frame taken
+ *
+ *  The lowest free frame, or the top of the magazine of the CPU. RAM is
+ *  only full once the magazines of the other CPUs are empty too.
+ */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+{
+   int ret;
+#ifdef FRAME_MAG
+   struct memphy_mag_t *mag = memphy_mag(mp);
+
+   if (mag != NULL) {
+      if (memphy_mag_pop(mag, retfpn) == 0)
+         return 0;
+      /* Empty, and only its owner fills it */
+      int batch[FRAME_MAG / 2], k = 0;
+
+      pthread_mutex_lock(&mp->mutex);
+      while (k < FRAME_MAG / 2 && memphy_alloc(mp, &batch[k]) == 0)
+         k++;
+      pthread_mutex_unlock(&mp->mutex);
+      if (k == 0)
+         return memphy_steal(mp, mag, retfpn);
+      *retfpn = batch[0];
+      /* The lowest frame is handed out, the next ends up on top */
+      while (k > 1)
+         memphy_mag_push(mag, batch[--k]);
+      return 0;
+   }
+#endif
+   pthread_mutex_lock(&mp->mutex);
+   ret = memphy_alloc(mp, retfpn);
+   pthread_mutex_unlock(&mp->mutex);
+   return ret;
+}
+
+/*
+ *  MEMPHY_get_freefp_range - take the lowest run of contiguous free frames
+ *  @mp: memphy struct
+ *  @num: number of frames
+ *  @retfpn: first frame of the run
+ */
+int MEMPHY_get_freefp_range(struct memphy_struct *mp, int num, int *retfpn)
 {
    pthread_mutex_lock(&mp->mutex);
-   struct framephy_struct *fp = mp->free_fp_list;
+   int w, start = 0, run = 0;
 
-   if (fp == NULL) {
+   if (num <= 0 || num > mp->fp_nfree) {
       pthread_mutex_unlock(&mp->mutex);
-     return -1;
+      return -1;
+   }
+   for (w = mp->fp_hint * 64; w < mp->fp_words && run < num; w++) {
+      uint64_t freefp = ~mp->fp_bitmap[w];
+      int b = 0;
+
+      if (freefp == ~0ULL) {
+         if (run == 0)
+            start = w * 64;
+         run += 64;
+         continue;
+      }
+      /* Jump from run to run of free frames in the word, the bits
+       * shifted in above bit 63 - b are zeroes, so ~rest is never 0 */
+      while (b < 64 && run < num) {
+         uint64_t rest = freefp >> b;
+         int n;
+
+         if (!(rest & 1)) {
+            run = 0;
+            if (rest == 0)
+               break;
+            b += __builtin_ctzll(rest);
+            continue;
+         }
+         n = __builtin_ctzll(~rest);
+         if (run == 0)
+            start = w * 64 + b;
+         run += n;
+         b += n;
+      }
+   }
+   if (run < num) {
+      pthread_mutex_unlock(&mp->mutex);
+      return -1;
+   }
+   *retfpn = start;
+   for (run = 0; run < num; ) {
+      int fpn = start + run;
+      int n = 64 - fpn % 64;
+      if (n > num - run)
+         n = num - run;
+      memphy_take(mp, fpn, n);
+      run += n;
    }
-   *retfpn = fp->fpn;
-   mp->free_fp_list = fp->fp_next;
-   /* MEMPHY is iteratively used up until its exhausted
-    * No garbage collector acting then it not been released
-    */
-   free(fp);
    pthread_mutex_unlock(&mp->mutex);
    return 0;
 }
@@ -187,6 +725,10 @@ int MEMPHY_dump(struct memphy_struct * mp)
    printf(ANSI_COLOR_GREEN "Print content of RAM (only print nonzero value)\n");
    for (int i = 0; i < mp->maxsz; i++)
    {
+      if (!memphy_live(mp, i)) {
+         i += memphy_span(i, mp->maxsz) - 1;
+         continue;
+      }
       if (mp->storage[i] != 0)
       {
          printf("---------------------------------\n");
@@ -202,13 +744,13 @@ int MEMPHY_dump(struct memphy_struct * mp)
 
 int RAM_dump(struct memphy_struct *mram)
 {
-  int freeCnt = 0;
-  struct framephy_struct *fpit = mram->free_fp_list;
-  while (fpit != NULL)
-  {
-    fpit = fpit->fp_next;
-    freeCnt++;
-  }
+  pthread_mutex_lock(&mram->mutex);
+  int freeCnt = mram->fp_nfree;
+  pthread_mutex_unlock(&mram->mutex);
+#ifdef FRAME_MAG
+  for (int i = 0; i < mram->nmag; i++)
+    freeCnt += memphy_mag_count(&mram->mag[i]);
+#endif
   printf(ANSI_COLOR_CYAN "----------- RAM mapping status -----------\n");
   printf("Number of mapped frames:\t%d\n", mram->maxsz / PAGING_PAGESZ - freeCnt);
   printf("Number of remaining frames:\t%d\n", freeCnt);
@@ -218,27 +760,124 @@ int RAM_dump(struct memphy_struct *mram)
 
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 {
-   pthread_mutex_lock(&mp->mutex);
-   struct framephy_struct *fp = mp->free_fp_list;
-   struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+#ifdef FRAME_MAG
+   struct memphy_mag_t *mag = memphy_mag(mp);
+
+   if (mag != NULL) {
+      /* Nobody maps the frame any more, its count needs no lock */
+      mp->fp_ref[fpn] = 0;
+      mp->fp_shared[fpn] = 0;
+      if (memphy_mag_count(mag) == FRAME_MAG) {
+         /* Spill the oldest half, the frames freed longest ago, the
+          * way a thief takes them */
+         int batch[FRAME_MAG / 2], k = 0;
 
-   /* Create new node with value fpn */
-   newnode->fpn = fpn;
-   newnode->fp_next = fp;
-   mp->free_fp_list = newnode;
+         while (k < FRAME_MAG / 2 && memphy_mag_steal(mag, &batch[k]) == 0)
+            k++;
+         pthread_mutex_lock(&mp->mutex);
+         while (k > 0)
+            memphy_release(mp, batch[--k]);
+         pthread_mutex_unlock(&mp->mutex);
+      }
+      memphy_mag_push(mag, fpn);
+      return 0;
+   }
+#endif
+   pthread_mutex_lock(&mp->mutex);
+   memphy_release(mp, fpn);
+   mp->fp_ref[fpn] = 0;
+   mp->fp_shared[fpn] = 0;
+   if (mp->zram != NULL)
+      zram_free(mp->zram, fpn);
    pthread_mutex_unlock(&mp->mutex);
    return 0;
 }
 
+/*
+ *  MEMPHY_get_ref - number of extra mappers of a frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ */
+int MEMPHY_get_ref(struct memphy_struct *mp, int fpn)
+{
+   pthread_mutex_lock(&mp->mutex);
+   int ref = mp->fp_ref[fpn];
+   pthread_mutex_unlock(&mp->mutex);
+   return ref;
+}
+
+/*
+ *  MEMPHY_ref - add a mapper to a frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ */
+int MEMPHY_ref(struct memphy_struct *mp, int fpn)
+{
+   pthread_mutex_lock(&mp->mutex);
+   int ref = ++mp->fp_ref[fpn];
+   pthread_mutex_unlock(&mp->mutex);
+   return ref;
+}
 
 /*
- *  Init MEMPHY struct
+ *  MEMPHY_unref - drop a mapper of a shared frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
  */
-int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+int MEMPHY_unref(struct memphy_struct *mp, int fpn)
+{
+   pthread_mutex_lock(&mp->mutex);
+   if (mp->fp_ref[fpn] > 0)
+      mp->fp_ref[fpn]--;
+   int ref = mp->fp_ref[fpn];
+   pthread_mutex_unlock(&mp->mutex);
+   return ref;
+}
+
+/*
+ *  MEMPHY_get_shared - check if a frame belongs to a shared segment
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ */
+int MEMPHY_get_shared(struct memphy_struct *mp, int fpn)
+{
+   pthread_mutex_lock(&mp->mutex);
+   int shared = mp->fp_shared[fpn];
+   pthread_mutex_unlock(&mp->mutex);
+   return shared;
+}
+
+/*
+ *  MEMPHY_set_shared - mark a frame as owned by a shared segment or not
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  @shared: new mark
+ */
+int MEMPHY_set_shared(struct memphy_struct *mp, int fpn, int shared)
+{
+   pthread_mutex_lock(&mp->mutex);
+   mp->fp_shared[fpn] = (shared != 0);
+   pthread_mutex_unlock(&mp->mutex);
+   return 0;
+}
+
+
+/* Everything but the storage of a new MEMPHY */
+static int memphy_setup(struct memphy_struct *mp, int max_size, int randomflg)
 {
    pthread_mutex_init(&mp->mutex, NULL);
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
    mp->maxsz = max_size;
+   mp->zram = NULL;
+   mp->mag = NULL;
+   mp->nmag = 0;
+   mp->fp_ref = (int *)calloc(max_size / PAGING_PAGESZ + 1, sizeof(int));
+   mp->fp_shared = (BYTE *)calloc(max_size / PAGING_PAGESZ + 1, sizeof(BYTE));
+   /* No frame at all on a device of size 0 */
+   mp->fp_bitmap = NULL;
+   mp->fp_summary = NULL;
+   mp->fp_words = 0;
+   mp->fp_nfree = 0;
+   mp->fp_hint = 0;
 
    MEMPHY_format(mp,PAGING_PAGESZ);
 
@@ -250,4 +889,92 @@ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
    return 0;
 }
 
+/*
+ *  Init MEMPHY struct
+ */
+int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+{
+   void *storage = MAP_FAILED;
+
+   /* Only address space is taken here, see memphy_commit() */
+   if (max_size > 0)
+      storage = mmap(NULL, max_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (storage != MAP_FAILED) {
+      int nchunk = (max_size + MEMPHY_CHUNK - 1) >> MEMPHY_CHUNK_SHIFT;
+
+      mp->storage = storage;
+      mp->chunk_map = calloc((nchunk + 63) / 64, sizeof(uint64_t));
+   }
+   else {
+      mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
+      mp->chunk_map = NULL;
+   }
+   return memphy_setup(mp, max_size, randomflg);
+}
+
+/*
+ *  init_memphy_file - init MEMPHY struct stored in a host file
+ *  @mp: memphy struct
+ *  @max_size: device size
+ *  @randomflg: random access device
+ *  @path: host file, created or grown to [max_size] if needed
+ *
+ *  The file is mapped shared, so the device may be larger than host
+ *  RAM. The content of an existing file is kept, a frame is always
+ *  written before it is read.
+ */
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg,
+                     const char *path)
+{
+   struct stat st;
+   int fd;
+
+   if (max_size <= 0)
+      return init_memphy(mp, max_size, randomflg);
+
+   if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+      printf(ANSI_COLOR_RED "ERROR: Cannot open swap file %s!\n" ANSI_COLOR_RESET, path);
+      return -1;
+   }
+   if (fstat(fd, &st) < 0
+       || (st.st_size < max_size && ftruncate(fd, max_size) < 0)) {
+      printf(ANSI_COLOR_RED "ERROR: Cannot size swap file %s!\n" ANSI_COLOR_RESET, path);
+      close(fd);
+      return -1;
+   }
+   mp->storage = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (mp->storage == MAP_FAILED) {
+      printf(ANSI_COLOR_RED "ERROR: Cannot map swap file %s!\n" ANSI_COLOR_RESET, path);
+      return -1;
+   }
+   mp->chunk_map = NULL; /* The file is mapped writable as a whole */
+   /* Frames are read and written one page at a time, in no order */
+   madvise(mp->storage, max_size, MADV_RANDOM);
+
+   return memphy_setup(mp, max_size, randomflg);
+}
+
+/*
+ *  init_memphy_zram - init MEMPHY struct stored compressed
+ *  @mp: memphy struct
+ *  @max_size: device size
+ *  @randomflg: random access device
+ *
+ *  The device has no flat storage, its frames are only reached by
+ *  MEMPHY_cp_page() which compresses and decompresses them.
+ */
+int init_memphy_zram(struct memphy_struct *mp, int max_size, int randomflg)
+{
+   if (max_size <= 0)
+      return init_memphy(mp, max_size, randomflg);
+
+   mp->storage = NULL;
+   mp->chunk_map = NULL;
+   memphy_setup(mp, max_size, randomflg);
+   mp->zram = zram_create(max_size / PAGING_PAGESZ, PAGING_PAGESZ);
+   return 0;
+}
+
 //#endif
@@ -0,0 +1,397 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Message queue module mm/mm-msg.c
+ *
+ * A message is a stack region handed over whole pages at a time: SEND
+ * moves the PTEs of the region out of the sender's page table and RECV
+ * maps them at the end of the receiver's vma0, so no byte is copied.
+ * A receiver finding its queue empty blocks until a sender hands the
+ * message to it directly.
+ */
+
+#include "mm.h"
+#include "iodev.h"
+#include "timer.h"
+#include "perf.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+struct msg_t {
+  uint32_t size;   // Message size in bytes
+  int off;         // Offset of the first byte in the first page
+  int npages;
+  uint32_t *pte;   // PTE of each page, in flight
+  struct msg_t *next;
+};
+
+struct msg_waiter_t {
+  struct pcb_t *proc;
+  int rgid;        // Region the message will be mapped as
+  struct msg_waiter_t *next;
+};
+
+struct msgq_t {
+  uint32_t key;
+  struct msg_t *head, *tail;
+  struct msg_waiter_t *wait_head, *wait_tail;
+  struct msgq_t *next;
+};
+
+/* Queues are created on first use and live until the simulation ends */
+static struct msgq_t *msgq_list = NULL;
+static pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* msgq_find - find a queue, create it if needed, msg_lock held
+ * @key: queue key
+ */
+static struct msgq_t *msgq_find(uint32_t key)
+{
+  struct msgq_t *q;
+
+  for (q = msgq_list; q != NULL; q = q->next)
+    if (q->key == key)
+      return q;
+  q = calloc(1, sizeof(struct msgq_t));
+  q->key = key;
+  q->next = msgq_list;
+  msgq_list = q;
+  return q;
+}
+
+/* msg_cut_freerg - drop the part of the vma0 free regions inside a range
+ * @vma: vma0
+ * @lo: first address of the range
+ * @hi: last address of the range
+ */
+static void msg_cut_freerg(struct vm_area_struct *vma, unsigned long lo, unsigned long hi)
+{
+  struct vm_rg_struct **rg = &vma->vm_freerg_list, *tmp;
+
+  while (*rg != NULL) {
+    tmp = *rg;
+    if (tmp->rg_end < lo || tmp->rg_start > hi) {
+      rg = &tmp->rg_next;
+      continue;
+    }
+    if (tmp->rg_start < lo && tmp->rg_end > hi) {
+      /* The range splits the free region in two */
+      struct vm_rg_struct *tail = init_vm_rg(hi + 1, tmp->rg_end, 0);
+      tail->rg_next = tmp->rg_next;
+      tmp->rg_next = tail;
+      tmp->rg_end = lo - 1;
+      rg = &tail->rg_next;
+    }
+    else if (tmp->rg_start < lo) {
+      tmp->rg_end = lo - 1;
+      rg = &tmp->rg_next;
+    }
+    else if (tmp->rg_end > hi) {
+      tmp->rg_start = hi + 1;
+      rg = &tmp->rg_next;
+    }
+    else {
+      *rg = tmp->rg_next;
+      free(tmp);
+    }
+  }
+}
+
+/* msg_take - move a region out of the caller into a new message
+ * @caller: sender
+ * @rgid: region ID
+ *
+ * The region must own the pages it spans. They are left unmapped, and
+ * so is their virtual range. Needs mm->lock and MEM_in_use.
+ */
+static struct msg_t *msg_take(struct pcb_t *caller, int rgid)
+{
+  struct mm_struct *mm = caller->mm;
+  struct vm_rg_struct *rgnode = get_symrg_byid(mm, rgid);
+  struct vm_area_struct *vma = get_vma_by_num(mm, 0);
+  struct msg_t *msg;
+  int first, last, it, pgn;
+
+  if (rgnode == NULL || rgnode->rg_start == rgnode->rg_end) {
+    printf(ANSI_COLOR_RED "\tSend invalid range\n" ANSI_COLOR_RESET);
+    return NULL;
+  }
+  if (rgnode->vmaid != 0) {
+    printf(ANSI_COLOR_RED "ERROR: Only ALLOC regions can be sent!\n" ANSI_COLOR_RESET);
+    return NULL;
+  }
+  first = PAGING_PGN(rgnode->rg_start);
+  last = PAGING_PGN(rgnode->rg_end);
+  for (it = 0; it < PAGING_MAX_SYMTBL_SZ; it++) {
+    struct vm_rg_struct *other = &mm->symrgtbl[it];
+    if (it == rgid || other->vmaid != 0 || other->rg_start == other->rg_end)
+      continue;
+    if ((int)PAGING_PGN(other->rg_end) >= first && (int)PAGING_PGN(other->rg_start) <= last) {
+      printf(ANSI_COLOR_RED "ERROR: Region %d shares a page with region %d. Send Failed!\n" ANSI_COLOR_RESET, rgid, it);
+      return NULL;
+    }
+  }
+  for (pgn = first; pgn <= last; pgn++) {
+    if (shm_attached(mm, pgn)) {
+      printf(ANSI_COLOR_RED "ERROR: Shared memory can not be sent!\n" ANSI_COLOR_RESET);
+      return NULL;
+    }
+  }
+
+  msg = malloc(sizeof(struct msg_t));
+  msg->size = rgnode->rg_end - rgnode->rg_start + 1;
+  msg->off = PAGING_OFFST(rgnode->rg_start);
+  msg->npages = last - first + 1;
+  msg->pte = malloc(msg->npages * sizeof(uint32_t));
+  msg->next = NULL;
+
+#ifdef LRU
+  /* In-flight frames stay in ram, off the LRU list */
+  free_LRU_pages(&mm->pgd[first], msg->npages);
+#endif
+  for (pgn = first; pgn <= last; pgn++) {
+    msg->pte[pgn - first] = mm->pgd[pgn];
+    mm->pgd[pgn] = 0;
+  }
+
+  /* Nothing may be allocated on the pages that left */
+  msg_cut_freerg(vma, first * PAGING_PAGESZ, (last + 1) * PAGING_PAGESZ - 1);
+  if (vma->sbrk < (unsigned long)(last + 1) * PAGING_PAGESZ)
+    vma->sbrk = (last + 1) * PAGING_PAGESZ;
+  rgnode->rg_start = 0;
+  rgnode->rg_end = 0;
+  return msg;
+}
+
+/* msg_map - map a message at the end of vma0 of the caller
+ * @caller: receiver
+ * @msg: message
+ * @rgid: region the message is mapped as
+ *
+ * Needs mm->lock and MEM_in_use.
+ */
+static int msg_map(struct pcb_t *caller, struct msg_t *msg, int rgid)
+{
+  struct mm_struct *mm = caller->mm;
+  struct vm_area_struct *vma = get_vma_by_num(mm, 0);
+  int start, end, pgn, i;
+
+  if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ
+      || mm->symrgtbl[rgid].rg_start != mm->symrgtbl[rgid].rg_end)
+    return -1;
+
+  start = vma->vm_end;
+  end = start + msg->npages * PAGING_PAGESZ;
+  if (end > caller->vmemsz) {
+    printf(ANSI_COLOR_RED "ERROR: Out of virtual memory. Receive Failed!\n" ANSI_COLOR_RESET);
+    return -1;
+  }
+  if (validate_overlap_vm_area(caller, 0, start, end) < 0)
+    return -1;
+
+  /* The tail of the last stack page stays allocatable */
+  if (vma->sbrk < vma->vm_end) {
+    struct vm_rg_struct *gap = init_vm_rg(vma->sbrk, vma->vm_end - 1, 0);
+    if (enlist_vm_freerg_list(mm, 0, gap) < 0)
+      free(gap);
+  }
+  vma->vm_end = end;
+  vma->sbrk = end;
+
+  mm->symrgtbl[rgid].rg_start = start + msg->off;
+  mm->symrgtbl[rgid].rg_end = start + msg->off + msg->size - 1;
+  mm->symrgtbl[rgid].vmaid = 0;
+
+  pgn = PAGING_PGN(start);
+  for (i = 0; i < msg->npages; i++) {
+    mm->pgd[pgn + i] = msg->pte[i];
+    if (!PAGING_PTE_PAGE_PRESENT(msg->pte[i]))
+      continue;
+#ifdef LRU
+    add_LRU_page(&mm->pgd[pgn + i], pgn + i);
+    PERF_INC(caller, lru_update);
+#else
+    enlist_pgn_node(&mm->fifo_pgn, pgn + i);
+#endif
+  }
+  free(msg->pte);
+  free(msg);
+  return 0;
+}
+
+/* msg_deliver - map a message in a process
+ * @proc: receiver
+ * @msg: message
+ * @rgid: region the message is mapped as
+ */
+static int msg_deliver(struct pcb_t *proc, struct msg_t *msg, int rgid)
+{
+  int val;
+
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  val = msg_map(proc, msg, rgid);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  return val;
+}
+
+/* msg_requeue - put a message that could not be mapped back at the
+ * head of its queue, for the next receiver. msg_lock held
+ * @q: queue the message came from
+ * @msg: message
+ */
+static void msg_requeue(struct msgq_t *q, struct msg_t *msg)
+{
+  msg->next = q->head;
+  q->head = msg;
+  if (q->tail == NULL)
+    q->tail = msg;
+}
+
+/*pgsend - PAGING-based send a region to a message queue
+ *@proc: Process executing the instruction
+ *@key: queue key
+ *@reg_index: memory region ID of the message, unmapped once sent
+ */
+int pgsend(struct pcb_t *proc, uint32_t key, uint32_t reg_index)
+{
+  struct msg_waiter_t *w, *failed = NULL, *failed_last = NULL;
+  struct msgq_t *q;
+  struct msg_t *msg;
+  int npages;
+
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  msg = msg_take(proc, reg_index);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  if (msg == NULL) {
+    printf(ANSI_COLOR_RED "\tSend FAILED\n" ANSI_COLOR_RESET);
+    return -1;
+  }
+  npages = msg->npages;
+
+#ifdef IODUMP
+  printf(ANSI_COLOR_PINK "Process %d send region=%d queue=%d pages=%d\n" ANSI_COLOR_RESET,
+         proc->pid, reg_index, key, npages);
+#endif
+  /* Hand the message to the oldest receiver that can map it. A
+   * receiver only runs again once it has one, those that failed stay
+   * blocked at the head of the waiters */
+  pthread_mutex_lock(&msg_lock);
+  q = msgq_find(key);
+  while ((w = q->wait_head) != NULL) {
+    q->wait_head = w->next;
+    if (q->wait_head == NULL)
+      q->wait_tail = NULL;
+    if (msg_deliver(w->proc, msg, w->rgid) == 0)
+      break;
+    printf(ANSI_COLOR_RED "\tRecv FAILED\n" ANSI_COLOR_RESET);
+    w->next = NULL;
+    if (failed_last == NULL)
+      failed = w;
+    else
+      failed_last->next = w;
+    failed_last = w;
+  }
+  if (w == NULL) {
+    if (q->tail == NULL)
+      q->head = msg;
+    else
+      q->tail->next = msg;
+    q->tail = msg;
+  }
+  if (failed != NULL) {
+    failed_last->next = q->wait_head;
+    if (q->wait_head == NULL)
+      q->wait_tail = failed_last;
+    q->wait_head = failed;
+  }
+  pthread_mutex_unlock(&msg_lock);
+  if (w != NULL) {
+    io_wakeup(w->proc);
+    free(w);
+  }
+  return 0;
+}
+
+/*pgrecv - PAGING-based receive a message, block if there is none
+ *@proc: Process executing the instruction
+ *@key: queue key
+ *@reg_index: memory region ID the message is mapped as
+ */
+int pgrecv(struct pcb_t *proc, uint32_t key, uint32_t reg_index)
+{
+  struct msgq_t *q;
+  struct msg_t *msg;
+  int val;
+
+  pthread_mutex_lock(&msg_lock);
+  q = msgq_find(key);
+  msg = q->head;
+  if (msg == NULL) {
+    struct msg_waiter_t *w = malloc(sizeof(struct msg_waiter_t));
+    w->proc = proc;
+    w->rgid = reg_index;
+    w->next = NULL;
+    if (q->wait_tail == NULL)
+      q->wait_head = w;
+    else
+      q->wait_tail->next = w;
+    q->wait_tail = w;
+    proc->state = PROC_BLOCKED;
+#ifdef PERFCTR
+    proc->perf.blocked_since = current_time();
+#endif
+    pthread_mutex_unlock(&msg_lock);
+#ifdef IODUMP
+    printf(ANSI_COLOR_PINK "Process %d recv queue=%d empty, waiting\n" ANSI_COLOR_RESET, proc->pid, key);
+#endif
+    return 0;
+  }
+  q->head = msg->next;
+  if (q->head == NULL)
+    q->tail = NULL;
+  msg->next = NULL;
+  pthread_mutex_unlock(&msg_lock);
+
+  val = msg_deliver(proc, msg, reg_index);
+  if (val < 0) {
+    /* Keep the message for the next receiver */
+    pthread_mutex_lock(&msg_lock);
+    msg_requeue(q, msg);
+    pthread_mutex_unlock(&msg_lock);
+    printf(ANSI_COLOR_RED "\tRecv FAILED\n" ANSI_COLOR_RESET);
+  }
+#ifdef IODUMP
+  printf(ANSI_COLOR_PINK "Process %d recv region=%d queue=%d\n" ANSI_COLOR_RESET, proc->pid, reg_index, key);
+#endif
+  return val;
+}
+
+/* msg_dump - report the processes still blocked on RECV at the end
+ * of the simulation, they never got a message and did not finish
+ */
+void msg_dump(void)
+{
+  struct msgq_t *q;
+  struct msg_waiter_t *w;
+
+  pthread_mutex_lock(&msg_lock);
+  for (q = msgq_list; q != NULL; q = q->next)
+    for (w = q->wait_head; w != NULL; w = w->next)
+      printf(ANSI_COLOR_RED "Process %d still blocked on recv queue=%u region=%d\n" ANSI_COLOR_RESET,
+             w->proc->pid, q->key, w->rgid);
+  pthread_mutex_unlock(&msg_lock);
+}
+
+//#endif
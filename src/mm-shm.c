@@ -0,0 +1,349 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Shared memory module mm/mm-shm.c
+ *
+ * A segment owns its frames through a master PTE per page. Every
+ * process attaching the segment maps the same frames as a region of
+ * its vma0, so a write by one mapper is seen by all of them. When a
+ * shared page is swapped out or in, the master and every attached
+ * PTE are rewritten together.
+ *
+ * All functions but the pg* wrappers expect MEM_in_use to be held.
+ */
+
+#include "mm.h"
+#include "perf.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+struct shm_att_t {
+  struct mm_struct *mm;
+  int rgid;  // Region the segment is mapped as
+  int pgn;   // First page of the mapping
+  struct shm_att_t *next;
+};
+
+struct shm_seg_t {
+  uint32_t key;
+  uint32_t size;
+  int npages;
+  uint32_t *pte; // Master PTE of each page
+  struct shm_att_t *att;
+  struct shm_seg_t *next;
+};
+
+/* Segments live until the simulation ends, like System V ones
+ * nobody removed */
+static struct shm_seg_t *shm_list = NULL;
+
+static struct shm_seg_t *shm_find(uint32_t key)
+{
+  struct shm_seg_t *seg;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next)
+    if (seg->key == key)
+      return seg;
+  return NULL;
+}
+
+/* shm_setpte - rewrite a page of a segment in the master and every mapper
+ * @seg: segment
+ * @i: page index in the segment
+ * @pte: new PTE
+ */
+static void shm_setpte(struct shm_seg_t *seg, int i, uint32_t pte)
+{
+  struct shm_att_t *att;
+
+  seg->pte[i] = pte;
+  for (att = seg->att; att != NULL; att = att->next)
+    att->mm->pgd[att->pgn + i] = pte;
+}
+
+/* shm_get - create a shared memory segment unless it exists
+ * @caller: caller
+ * @key: segment key
+ * @size: segment size in bytes
+ *
+ */
+int shm_get(struct pcb_t *caller, uint32_t key, uint32_t size)
+{
+  struct shm_seg_t *seg = shm_find(key);
+  struct framephy_struct *frm = NULL, *fpit;
+  int i;
+
+  if (seg != NULL) {
+    if (size > seg->size) {
+      printf(ANSI_COLOR_RED "ERROR: Segment %u is smaller than %u bytes!\n" ANSI_COLOR_RESET, key, size);
+      return -1;
+    }
+    return 0;
+  }
+  if (size == 0)
+    return -1;
+
+  seg = malloc(sizeof(struct shm_seg_t));
+  seg->key = key;
+  seg->size = size;
+  seg->npages = PAGING_PAGE_ALIGNSZ(size) / PAGING_PAGESZ;
+  seg->pte = calloc(seg->npages, sizeof(uint32_t));
+  seg->att = NULL;
+
+  if (alloc_pages_range(caller, seg->npages, &frm) < 0) {
+    printf(ANSI_COLOR_RED "ERROR: Out of memory. Shmget Failed!\n" ANSI_COLOR_RESET);
+    while (frm != NULL) {
+      fpit = frm->fp_next;
+      MEMPHY_put_freefp(caller->mram, frm->fpn);
+      free(frm);
+      frm = fpit;
+    }
+    free(seg->pte);
+    free(seg);
+    return -1;
+  }
+
+  for (i = 0; frm != NULL; i++) {
+    MEMPHY_fill(caller->mram, frm->fpn * PAGING_PAGESZ, 0, PAGING_PAGESZ);
+    MEMPHY_set_shared(caller->mram, frm->fpn, 1);
+    pte_set_fpn(&seg->pte[i], frm->fpn);
+#ifdef LRU
+    /* The master stands for the page until someone maps it */
+    add_LRU_page(&seg->pte[i], i);
+#endif
+    fpit = frm->fp_next;
+    free(frm);
+    frm = fpit;
+  }
+
+  seg->next = shm_list;
+  shm_list = seg;
+  return 0;
+}
+
+/* shm_attach - map a shared memory segment at the end of vma0
+ * @caller: caller
+ * @key: segment key
+ * @rgid: region the segment is mapped as
+ *
+ */
+int shm_attach(struct pcb_t *caller, uint32_t key, int rgid)
+{
+  struct shm_seg_t *seg = shm_find(key);
+  struct mm_struct *mm = caller->mm;
+  struct vm_area_struct *vma = get_vma_by_num(mm, 0);
+  struct shm_att_t *att;
+  int start, end, i;
+
+  if (seg == NULL) {
+    printf(ANSI_COLOR_RED "ERROR: No shared segment %u!\n" ANSI_COLOR_RESET, key);
+    return -1;
+  }
+  if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ
+      || mm->symrgtbl[rgid].rg_start != mm->symrgtbl[rgid].rg_end)
+    return -1;
+
+  start = vma->vm_end;
+  end = start + seg->npages * PAGING_PAGESZ;
+  if (end > caller->vmemsz) {
+    printf(ANSI_COLOR_RED "ERROR: Out of virtual memory. Attach Failed!\n" ANSI_COLOR_RESET);
+    return -1;
+  }
+  if (validate_overlap_vm_area(caller, 0, start, end) < 0)
+    return -1;
+
+  /* The tail of the last stack page stays allocatable */
+  if (vma->sbrk < vma->vm_end) {
+    struct vm_rg_struct *gap = init_vm_rg(vma->sbrk, vma->vm_end - 1, 0);
+    if (enlist_vm_freerg_list(mm, 0, gap) < 0)
+      free(gap);
+  }
+  vma->vm_end = end;
+  vma->sbrk = end;
+
+  mm->symrgtbl[rgid].rg_start = start;
+  mm->symrgtbl[rgid].rg_end = start + seg->size - 1;
+  mm->symrgtbl[rgid].vmaid = 0;
+
+  att = malloc(sizeof(struct shm_att_t));
+  att->mm = mm;
+  att->rgid = rgid;
+  att->pgn = PAGING_PGN(start);
+  att->next = seg->att;
+  seg->att = att;
+
+  for (i = 0; i < seg->npages; i++) {
+    mm->pgd[att->pgn + i] = seg->pte[i];
+    if (!PAGING_PTE_PAGE_PRESENT(seg->pte[i]))
+      continue;
+#ifdef LRU
+    add_LRU_page(&mm->pgd[att->pgn + i], att->pgn + i);
+    PERF_INC(caller, lru_update);
+#else
+    enlist_pgn_node(&mm->fifo_pgn, att->pgn + i);
+#endif
+  }
+  return 0;
+}
+
+/* shm_detach - unmap a region if it is a shared memory segment
+ * @mm: memory of the mapper
+ * @rgid: region ID
+ *
+ * Return 1 if the region was detached, 0 if it is not shared. The
+ * virtual range is not reused, its pages are left unmapped.
+ */
+int shm_detach(struct mm_struct *mm, int rgid)
+{
+  struct shm_seg_t *seg;
+  struct shm_att_t **att, *tmp;
+  int i;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next) {
+    for (att = &seg->att; *att != NULL; att = &(*att)->next) {
+      if ((*att)->mm != mm || (*att)->rgid != rgid)
+        continue;
+      tmp = *att;
+      *att = tmp->next;
+      for (i = 0; i < seg->npages; i++) {
+#ifdef LRU
+        /* The LRU node may hold this mapper's PTE */
+        if (PAGING_PTE_PAGE_PRESENT(seg->pte[i]))
+          add_LRU_page(&seg->pte[i], i);
+#endif
+        mm->pgd[tmp->pgn + i] = 0;
+      }
+      free(tmp);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* shm_attached - check if a page maps a shared memory segment
+ * @mm: memory of the mapper
+ * @pgn: page number
+ *
+ */
+int shm_attached(struct mm_struct *mm, int pgn)
+{
+  struct shm_seg_t *seg;
+  struct shm_att_t *att;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next)
+    for (att = seg->att; att != NULL; att = att->next)
+      if (att->mm == mm && pgn >= att->pgn && pgn < att->pgn + seg->npages)
+        return 1;
+  return 0;
+}
+
+/* shm_fork - attach a child to every segment its parent has attached
+ * @mm: memory of the parent
+ * @cmm: memory of the child, a copy of the parent's layout
+ *
+ */
+int shm_fork(struct mm_struct *mm, struct mm_struct *cmm)
+{
+  struct shm_seg_t *seg;
+  struct shm_att_t *att, *catt;
+  int i;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next) {
+    for (att = seg->att; att != NULL; att = att->next) {
+      if (att->mm != mm)
+        continue;
+      catt = malloc(sizeof(struct shm_att_t));
+      catt->mm = cmm;
+      catt->rgid = att->rgid;
+      catt->pgn = att->pgn;
+      catt->next = seg->att;
+      seg->att = catt;
+      for (i = 0; i < seg->npages; i++)
+        cmm->pgd[catt->pgn + i] = seg->pte[i];
+    }
+  }
+  return 0;
+}
+
+/* shm_exit - detach every segment of a memory being freed
+ * @mm: memory of the mapper
+ *
+ */
+int shm_exit(struct mm_struct *mm)
+{
+  struct shm_seg_t *seg;
+  struct shm_att_t *att;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next) {
+    att = seg->att;
+    while (att != NULL) {
+      if (att->mm == mm) {
+        shm_detach(mm, att->rgid);
+        att = seg->att; /* the list changed, rescan it */
+      }
+      else {
+        att = att->next;
+      }
+    }
+  }
+  return 0;
+}
+
+/* shm_swapout - move every mapping of a shared frame to swap
+ * @mram: ram device
+ * @fpn: frame in ram being swapped out
+ * @swptyp: swap type
+ * @swpoff: swap offset
+ *
+ * Return 1 if the frame belongs to a segment, 0 otherwise.
+ */
+int shm_swapout(struct memphy_struct *mram, int fpn, int swptyp, int swpoff)
+{
+  struct shm_seg_t *seg;
+  int i;
+
+  if (!MEMPHY_get_shared(mram, fpn))
+    return 0;
+  MEMPHY_set_shared(mram, fpn, 0);
+  for (seg = shm_list; seg != NULL; seg = seg->next) {
+    for (i = 0; i < seg->npages; i++) {
+      uint32_t pte = seg->pte[i];
+      if (PAGING_PTE_PAGE_PRESENT(pte) && PAGING_PTE_FPN(pte) == fpn) {
+        pte_set_swap(&pte, swptyp, swpoff);
+        shm_setpte(seg, i, pte);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* shm_swapin - map every mapping of a shared page to its new frame
+ * @mram: ram device
+ * @swptyp: swap type the page was in
+ * @swpoff: swap offset the page was in
+ * @fpn: frame in ram holding the page now
+ *
+ * Return 1 if the page belongs to a segment, 0 otherwise.
+ */
+int shm_swapin(struct memphy_struct *mram, int swptyp, int swpoff, int fpn)
+{
+  struct shm_seg_t *seg;
+  int i;
+
+  for (seg = shm_list; seg != NULL; seg = seg->next) {
+    for (i = 0; i < seg->npages; i++) {
+      uint32_t pte = seg->pte[i];
+      if (PAGING_PTE_PAGE_SWAPPED(pte) && !PAGING_PTE_PAGE_PRESENT(pte)
+          && (int)PAGING_SWPTYP(pte) == swptyp && (int)PAGING_SWPOFF(pte) == swpoff) {
+        pte_set_fpn(&pte, fpn);
+        shm_setpte(seg, i, pte);
+        MEMPHY_set_shared(mram, fpn, 1);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+//#endif
@@ -0,0 +1,385 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Swap I/O module mm/mm-swapio.c
+ *
+ * Swap frames are read and written by a pool of host threads. An
+ * evicted page is copied to a buffer of its own and queued, so the
+ * frame is reused at once while the worker writes the swap device. A
+ * page fault queues a read and lets MEM_in_use go while it waits, so
+ * the faults of several CPUs are served at the same time and the other
+ * CPUs go on with their slot. The faulting process keeps its CPU: the
+ * CPU thread waits inside the instruction, and as a slot only ends once
+ * every CPU is done with it, simulated time stands still until the read
+ * is back. Unlike IO or RECV, a fault does not block the process, that
+ * would need the instructions touching several pages to be restartable.
+ * Each request carries a completion callback, run by the worker when
+ * the device is done with it.
+ *
+ * A request stays findable by its swap frame while it is in flight: a
+ * fault on a page still queued for writing is served from its buffer,
+ * a write whose swap frame is freed before a worker got it is dropped,
+ * and a swap frame freed while its write runs is only given back by
+ * the write completion, so it cannot be written twice at once.
+ *
+ * Workers never take MEM_in_use, the caller may hold it while it waits
+ * for room in the queue. Lock order is MEM_in_use, then swapio_lock,
+ * then the mutex of a device.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SWAPIO_HASH   256 // Buckets of the in-flight requests
+#define SWAPIO_DEPTH  64  // Most requests in flight, more writes wait
+
+enum { SWAPIO_QUEUED, SWAPIO_BUSY, SWAPIO_DONE };
+
+struct swapio_req_t {
+  int rw;                      // 0 read, 1 write
+  struct memphy_struct *dev;   // Swap device
+  int off;                     // Swap frame
+  int state;
+  int ret;
+  int release;                 // Write: give the swap frame back once done
+  void (*done)(struct swapio_req_t *req);
+  struct swapio_req_t *qnext;  // Work queue
+  struct swapio_req_t *hnext;  // In-flight hash chain
+  BYTE page[PAGING_PAGESZ];
+};
+
+static pthread_mutex_t swapio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t swapio_work = PTHREAD_COND_INITIALIZER; // Queue not empty
+static pthread_cond_t swapio_idle = PTHREAD_COND_INITIALIZER; // A request completed or retired
+static struct swapio_req_t *swapio_head, *swapio_tail;
+static struct swapio_req_t *swapio_hash[SWAPIO_HASH];
+static pthread_t *swapio_thread;
+static int swapio_nthread;
+static int swapio_stopping;
+static int swapio_depth;
+
+/* Totals over the run */
+static struct {
+  unsigned long nread;   // Pages read by the workers
+  unsigned long nwrite;  // Pages written by the workers
+  unsigned long nhit;    // Faults served from a queued write
+  unsigned long nshare;  // Faults that waited on the read of another
+  unsigned long ncancel; // Writes dropped before reaching the device
+  int peak;              // Most requests in flight at once
+} swapio_stat;
+
+static inline int swapio_bucket(struct memphy_struct *dev, int off)
+{
+  return (int)(((uintptr_t)dev >> 4) * 31 + off) & (SWAPIO_HASH - 1);
+}
+
+/* In-flight request on a swap frame, swapio_lock held */
+static struct swapio_req_t *swapio_find(struct memphy_struct *dev, int off)
+{
+  struct swapio_req_t *r = swapio_hash[swapio_bucket(dev, off)];
+
+  while (r != NULL && (r->dev != dev || r->off != off))
+    r = r->hnext;
+  return r;
+}
+
+static void swapio_unlink(struct swapio_req_t *req)
+{
+  struct swapio_req_t **p = &swapio_hash[swapio_bucket(req->dev, req->off)];
+
+  while (*p != req)
+    p = &(*p)->hnext;
+  *p = req->hnext;
+  swapio_depth--;
+}
+
+/* Take a request off the work queue before a worker got it */
+static void swapio_dequeue(struct swapio_req_t *req)
+{
+  struct swapio_req_t **p = &swapio_head, *prev = NULL;
+
+  while (*p != req) {
+    prev = *p;
+    p = &(*p)->qnext;
+  }
+  *p = req->qnext;
+  if (swapio_tail == req)
+    swapio_tail = prev;
+}
+
+static void swapio_submit(struct swapio_req_t *req)
+{
+  int b = swapio_bucket(req->dev, req->off);
+
+  req->state = SWAPIO_QUEUED;
+  req->hnext = swapio_hash[b];
+  swapio_hash[b] = req;
+  req->qnext = NULL;
+  if (swapio_tail != NULL)
+    swapio_tail->qnext = req;
+  else
+    swapio_head = req;
+  swapio_tail = req;
+  if (++swapio_depth > swapio_stat.peak)
+    swapio_stat.peak = swapio_depth;
+  pthread_cond_signal(&swapio_work);
+}
+
+/* Completion of a read, the faulting thread takes the page */
+static void swapio_read_done(struct swapio_req_t *req)
+{
+  req->state = SWAPIO_DONE;
+}
+
+/* Completion of a write, the buffer is no longer needed */
+static void swapio_write_done(struct swapio_req_t *req)
+{
+  if (req->ret < 0)
+    printf("Swap write of frame %d failed\n", req->off);
+  swapio_unlink(req);
+  if (req->release)
+    MEMPHY_put_freefp(req->dev, req->off);
+  free(req);
+}
+
+static void *swapio_routine(void *arg)
+{
+  struct swapio_req_t *req;
+
+  (void)arg;
+  pthread_mutex_lock(&swapio_lock);
+  for (;;) {
+    while (swapio_head == NULL && !swapio_stopping)
+      pthread_cond_wait(&swapio_work, &swapio_lock);
+    if ((req = swapio_head) == NULL)
+      break;
+    if ((swapio_head = req->qnext) == NULL)
+      swapio_tail = NULL;
+
+    req->state = SWAPIO_BUSY;
+    pthread_mutex_unlock(&swapio_lock);
+    if (req->rw)
+      req->ret = MEMPHY_write_page(req->dev, req->off, req->page, PAGING_PAGESZ);
+    else
+      req->ret = MEMPHY_read_page(req->dev, req->off, req->page, PAGING_PAGESZ);
+    pthread_mutex_lock(&swapio_lock);
+    if (req->rw)
+      swapio_stat.nwrite++;
+    else
+      swapio_stat.nread++;
+    req->done(req);
+    pthread_cond_broadcast(&swapio_idle);
+  }
+  pthread_mutex_unlock(&swapio_lock);
+  return NULL;
+}
+
+/*
+ * swapio_start - start the workers of the swap I/O engine
+ * @nthread: number of workers, 0 does every swap I/O on the caller
+ *
+ */
+int swapio_start(int nthread)
+{
+  int i;
+
+  if (nthread <= 0)
+    return 0;
+  swapio_thread = malloc(nthread * sizeof(pthread_t));
+  for (i = 0; i < nthread; i++) {
+    if (pthread_create(&swapio_thread[i], NULL, swapio_routine, NULL) != 0)
+      break;
+  }
+  swapio_nthread = i;
+  return (i == nthread) ? 0 : -1;
+}
+
+/*
+ * swapio_stop - finish the queued requests and stop the workers
+ *
+ */
+void swapio_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&swapio_lock);
+  swapio_stopping = 1;
+  pthread_cond_broadcast(&swapio_work);
+  pthread_mutex_unlock(&swapio_lock);
+  for (i = 0; i < swapio_nthread; i++)
+    pthread_join(swapio_thread[i], NULL);
+  free(swapio_thread);
+  swapio_thread = NULL;
+  swapio_nthread = 0;
+}
+
+/*
+ * swapio_read - read a swap frame for a page fault
+ * @mswp: swap device
+ * @swpoff: swap frame
+ * @page: buffer of a page
+ *
+ * Must be called with MEM_in_use held, which is let go while a worker
+ * reads the device, the calling CPU thread waits for it. Return 0 with
+ * the page read, 1 when the lock was let go without reading, the
+ * caller has to look at its PTE again.
+ */
+int swapio_read(struct memphy_struct *mswp, int swpoff, BYTE *page)
+{
+  struct swapio_req_t *req;
+  int ret;
+
+  if (swapio_nthread == 0)
+    return MEMPHY_read_page(mswp, swpoff, page, PAGING_PAGESZ);
+
+  pthread_mutex_lock(&swapio_lock);
+  req = swapio_find(mswp, swpoff);
+  if (req != NULL && req->rw) {
+    /* Still queued for writing, its buffer is the page */
+    memcpy(page, req->page, PAGING_PAGESZ);
+    swapio_stat.nhit++;
+    pthread_mutex_unlock(&swapio_lock);
+    return 0;
+  }
+
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
+  if (req != NULL) {
+    /* Another CPU faults on the same frame, wait for it to be done */
+    swapio_stat.nshare++;
+    while (swapio_find(mswp, swpoff) == req)
+      pthread_cond_wait(&swapio_idle, &swapio_lock);
+    ret = 1;
+  }
+  else {
+    req = malloc(sizeof(struct swapio_req_t));
+    req->rw = 0;
+    req->dev = mswp;
+    req->off = swpoff;
+    req->release = 0;
+    req->done = swapio_read_done;
+    swapio_submit(req);
+    while (req->state != SWAPIO_DONE)
+      pthread_cond_wait(&swapio_idle, &swapio_lock);
+    memcpy(page, req->page, PAGING_PAGESZ);
+    ret = req->ret;
+    swapio_unlink(req);
+    free(req);
+    pthread_cond_broadcast(&swapio_idle);
+  }
+  pthread_mutex_unlock(&swapio_lock);
+#ifdef SYNC
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  return ret;
+}
+
+/*
+ * swapio_write - queue a RAM frame to be written to a swap frame
+ * @mram: RAM
+ * @fpn: RAM frame, free to reuse on return
+ * @mswp: swap device
+ * @swpoff: swap frame
+ *
+ */
+int swapio_write(struct memphy_struct *mram, int fpn, struct memphy_struct *mswp, int swpoff)
+{
+  struct swapio_req_t *req;
+
+  if (swapio_nthread == 0)
+    return MEMPHY_cp_page(mram, fpn, mswp, swpoff, PAGING_PAGESZ);
+
+  req = malloc(sizeof(struct swapio_req_t));
+  if (MEMPHY_read_page(mram, fpn, req->page, PAGING_PAGESZ) < 0) {
+    free(req);
+    return -1;
+  }
+  req->rw = 1;
+  req->dev = mswp;
+  req->off = swpoff;
+  req->ret = 0;
+  req->release = 0;
+  req->done = swapio_write_done;
+
+  pthread_mutex_lock(&swapio_lock);
+  while (swapio_depth >= SWAPIO_DEPTH)
+    pthread_cond_wait(&swapio_idle, &swapio_lock);
+  swapio_submit(req);
+  pthread_mutex_unlock(&swapio_lock);
+  return 0;
+}
+
+/*
+ * swapio_copy - copy a swap frame to another swap frame
+ * @src: source swap device
+ * @srcoff: source swap frame
+ * @dst: destination swap device
+ * @dstoff: destination swap frame
+ *
+ */
+int swapio_copy(struct memphy_struct *src, int srcoff, struct memphy_struct *dst, int dstoff)
+{
+  struct swapio_req_t *req;
+  int ret;
+
+  pthread_mutex_lock(&swapio_lock);
+  req = swapio_find(src, srcoff);
+  if (req != NULL && req->rw) {
+    /* The device is not written yet, the buffer does not change */
+    ret = MEMPHY_write_page(dst, dstoff, req->page, PAGING_PAGESZ);
+    pthread_mutex_unlock(&swapio_lock);
+    return ret;
+  }
+  pthread_mutex_unlock(&swapio_lock);
+  return MEMPHY_cp_page(src, srcoff, dst, dstoff, PAGING_PAGESZ);
+}
+
+/*
+ * swapio_release - give a swap frame back
+ * @mswp: swap device
+ * @swpoff: swap frame
+ *
+ */
+int swapio_release(struct memphy_struct *mswp, int swpoff)
+{
+  struct swapio_req_t *req;
+
+  pthread_mutex_lock(&swapio_lock);
+  req = swapio_find(mswp, swpoff);
+  if (req != NULL && req->rw && req->state == SWAPIO_BUSY) {
+    /* The write completion gives it back */
+    req->release = 1;
+    pthread_mutex_unlock(&swapio_lock);
+    return 0;
+  }
+  if (req != NULL && req->rw) {
+    /* Not written yet and no longer needed */
+    swapio_dequeue(req);
+    swapio_unlink(req);
+    free(req);
+    swapio_stat.ncancel++;
+    pthread_cond_broadcast(&swapio_idle);
+  }
+  pthread_mutex_unlock(&swapio_lock);
+  return MEMPHY_put_freefp(mswp, swpoff);
+}
+
+/*
+ * swapio_dump - print what the swap I/O engine did
+ *
+ */
+void swapio_dump(void)
+{
+  if (swapio_stat.nread + swapio_stat.nwrite + swapio_stat.nhit + swapio_stat.ncancel == 0)
+    return;
+  printf("Swap I/O: %lu reads, %lu writes, %lu faults served from the write queue, "
+         "%lu waited on another fault, %lu writes dropped, peak %d in flight\n",
+         swapio_stat.nread, swapio_stat.nwrite, swapio_stat.nhit,
+         swapio_stat.nshare, swapio_stat.ncancel, swapio_stat.peak);
+}
+
+//#endif
@@ -6,10 +6,15 @@
 
 #include "string.h"
 #include "mm.h"
+#include "perf.h"
 #include <stdlib.h>
 #include <stdio.h>
 
 #ifdef LRU
+pthread_mutex_t LRU_lock = PTHREAD_MUTEX_INITIALIZER;
+struct LRU_list *lru_head = NULL;
+struct LRU_list *lru_tail = NULL;
+
 /* update_LRU_lst - update LRU list when there are reference 
  * (e.g: read, write) to existing page in that list
  * @pte: page table entry
@@ -94,6 +99,10 @@ int add_LRU_page(uint32_t *pte, int pgn)
     }
     if (flag == 1)
     {
+      /* The frame may now be reached through another mapper's PTE */
+      p->pte = pte;
+      p->pgn = pgn;
+      free(tmp);
       if (p == lru_head)
       {
         if (lru_head == lru_tail)
@@ -139,38 +148,84 @@ int add_LRU_page(uint32_t *pte, int pgn)
   return 0;
 }
 
+/* unlink_LRU_page - remove a node from the LRU list, LRU_lock held
+ * @p: node
+ */
+static void unlink_LRU_page(struct LRU_list *p)
+{
+  if (p->lru_pre != NULL)
+    p->lru_pre->lru_next = p->lru_next;
+  else
+    lru_head = p->lru_next;
+  if (p->lru_next != NULL)
+    p->lru_next->lru_pre = p->lru_pre;
+  else
+    lru_tail = p->lru_pre;
+  p->lru_pre = p->lru_next = NULL;
+}
+
 /* find_LRU_victim_page - find next page to swap out 
  * with LRU replacement policy
+ * @mram: RAM the victim frame lives in
  * @pgn: returned page number
  * @fpn: returned frame number
  * @pte: returned page table entry
+ *
+ * Frames shared copy-on-write are skipped, since swapping them out
+ * would need every mapper's PTE. A node whose PTE no longer maps its
+ * frame (the mapper broke the sharing) is dropped on the way.
  */
-int find_LRU_victim_page(int* pgn, int* fpn, uint32_t** pte) {
+int find_LRU_victim_page(struct memphy_struct *mram, int* pgn, int* fpn, uint32_t** pte) {
 #ifdef SYNC
   pthread_mutex_lock(&LRU_lock);
 #endif
-  if (lru_head == NULL) {
+  struct LRU_list *temp = lru_head;
+  while (temp != NULL) {
+    struct LRU_list *next = temp->lru_next;
+    if (!PAGING_PTE_PAGE_PRESENT(*temp->pte) || PAGING_PTE_FPN(*temp->pte) != temp->fpn) {
+      unlink_LRU_page(temp);
+      free(temp);
+    }
+    else if (MEMPHY_get_ref(mram, temp->fpn) == 0) {
+      break;
+    }
+    temp = next;
+  }
+  if (temp == NULL) {
 #ifdef SYNC
     pthread_mutex_unlock(&LRU_lock);
 #endif
     return -1;
   }
-  struct LRU_list *temp = lru_head;
   *pgn = temp->pgn; // get victim pgn
   *fpn = temp->fpn; // get victim fpn
   *pte = temp->pte;
-  if (lru_head == lru_tail) {
-    lru_head = lru_tail = NULL;
-  }
-  else {
-    lru_head = lru_head->lru_next;
+  unlink_LRU_page(temp);
+  // free(temp);
+#ifdef SYNC
+  pthread_mutex_unlock(&LRU_lock);
+#endif
+  return 0;
+}
 
-    if (lru_head != NULL) {
-      lru_head->lru_pre = NULL;
+/* free_LRU_pages - drop the LRU nodes of a page table being freed
+ * @pgd: page table
+ * @n: number of entries
+ */
+int free_LRU_pages(uint32_t *pgd, int n)
+{
+#ifdef SYNC
+  pthread_mutex_lock(&LRU_lock);
+#endif
+  struct LRU_list *temp = lru_head;
+  while (temp != NULL) {
+    struct LRU_list *next = temp->lru_next;
+    if (temp->pte >= pgd && temp->pte < pgd + n) {
+      unlink_LRU_page(temp);
+      free(temp);
     }
-    temp->lru_next = NULL;
+    temp = next;
   }
-  // free(temp);
 #ifdef SYNC
   pthread_mutex_unlock(&LRU_lock);
 #endif
@@ -258,7 +313,7 @@ struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
  */
 struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
 {
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if(rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
     return NULL;
 
   return &mm->symrgtbl[rgid];
@@ -273,134 +328,114 @@ struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
  */
 int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
 {
-  #ifdef LRU
 #ifdef SYNC
   pthread_mutex_lock(&MEM_in_use);
 #endif
-  uint32_t pte = mm->pgd[pgn];
-  if (!PAGING_PTE_PAGE_PRESENT(pte)) { 
-    int fpn_temp = -1;
-    if (MEMPHY_get_freefp(caller->mram, &fpn_temp) == 0) {
-      int tgtfpn = PAGING_PTE_FPN(pte);
-      __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, fpn_temp);
-      pte_set_fpn(&mm->pgd[pgn], fpn_temp);
-    }
-    else {
-      int tgtfpn = PAGING_PTE_FPN(pte);
-      int vicfpn, swpfpn, vicpgn;
-      uint32_t* vicpte;
-      // get victim page 
-      find_LRU_victim_page(&vicpgn, &vicfpn, &vicpte);
-      if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) < 0) {
-        printf("Out of SWAP");
+  uint32_t *pte = &mm->pgd[pgn];
+
+  if (!PAGING_PTE_PAGE_PRESENT(*pte))
+  { /* Page is not online, make it actively living */
+    int ret;
+    if (!PAGING_PTE_PAGE_SWAPPED(*pte)) {
 #ifdef SYNC
-        pthread_mutex_unlock(&MEM_in_use);
+      pthread_mutex_unlock(&MEM_in_use);
 #endif
-        return -3000;
-      }
-#ifdef RAM_STATUS_DUMP
-      printf(ANSI_COLOR_PINK "[Page Replacement]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\tTarget:%d\t\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte, tgtfpn);
-#endif
-      // Copy victim frame to swap
-      __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-      // Copy target frame from swap to mem 
-      __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
-      /* Find index of avtive memswap */
-      int index_of_active_mswp;
-      for (index_of_active_mswp = 0; index_of_active_mswp < PAGING_MAX_MMSWP; index_of_active_mswp++) {
-        if ((struct memphy_struct *)&caller->mswp[index_of_active_mswp] == caller->active_mswp) break;
-      }
-      printf("Debug: vicfpn: %d, swpfpn: %d, tgtfpn: %d\n, index_active: %d\n", vicfpn, swpfpn, tgtfpn, index_of_active_mswp);
-      pte_set_swap(vicpte, index_of_active_mswp, swpfpn);
-      // signal pte has new fpn
-      pte_set_fpn(&mm->pgd[pgn], vicfpn);
-
-#ifdef RAM_STATUS_DUMP
-      printf(ANSI_COLOR_PINK "[After Swap]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\tTarget:%d\t\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte, tgtfpn);
+      return -1; /* page was never mapped */
+    }
+    PERF_INC(caller, pgfault);
+    /* The swap frame may be read by another CPU meanwhile, then the
+     * page is present or moved when pg_swapin() is back */
+    while ((ret = pg_swapin(caller, pte, pgn, fpn)) > 0
+           && PAGING_PTE_PAGE_SWAPPED(*pte))
+      ;
+    if (ret < 0 || !PAGING_PTE_PAGE_PRESENT(*pte)) {
+      printf("No page to swap out\n");
+#ifdef SYNC
+      pthread_mutex_unlock(&MEM_in_use);
 #endif
-      MEMPHY_put_freefp(caller->active_mswp, tgtfpn);
+      return (ret < 0) ? ret : -1;
     }
   }
-  add_LRU_page(&mm->pgd[pgn], pgn);
-  // *fpn = GETVAL(mm->pgd[pgn], PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
-  *fpn = PAGING_PTE_FPN(mm->pgd[pgn]);
+#ifdef LRU
+  add_LRU_page(pte, pgn);
+  PERF_INC(caller, lru_update);
+#endif
+  *fpn = PAGING_PTE_FPN(*pte);
 #ifdef SYNC
   pthread_mutex_unlock(&MEM_in_use);
 #endif
-  #else
-  #ifdef SYNC
-    pthread_mutex_lock(&MEM_in_use);
-  #endif
-  uint32_t pte = mm->pgd[pgn];
- 
-  if (!PAGING_PTE_PAGE_PRESENT(pte))
-  { /* Page is not online, make it actively living */
-    printf("\tPage is not online, make it actively living\n");
-    int vicfpn;
-
-    // int tgtfpn = PAGING_SWP(pte);//the target frame storing our variable ~ bit 8 -> bit 23 * 8
-    int swpoff = PAGING_SWPOFF(pte); // Frame storing our variable ~ bit 5 -> bit 25
-    int swptyp = PAGING_SWPTYP(pte); // Index of memswap 
-
-
-    /* TODO: Play with your paging theory here */
-    if (MEMPHY_get_freefp(caller->mram, &vicfpn) < 0) // RAM doesn't have any free frame -> Paging
-    {
-      printf("\tRAM doesn't have any free frame -> Paging\n");
-      int vicpgn, swpfpn; 
-      uint32_t vicpte;
-      /* Find victim page */
-      if (find_victim_page(mm, &vicpgn) < 0) return -1;
-
-      vicpte = mm->pgd[vicpgn];
-      vicfpn = PAGING_PTE_FPN(vicpte);
-      printf("\tVictim pgn: %d - Victim fpn: %d\n", vicpgn, vicfpn);
-      /* Find index of active memswap */
-      int index_of_active_mswp;
-      for (index_of_active_mswp = 0; index_of_active_mswp < PAGING_MAX_MMSWP; index_of_active_mswp++) {
-        if ((struct memphy_struct *)&caller->mswp[index_of_active_mswp] == caller->active_mswp) break;
-      }
+  return 0;
+}
 
-      /* Get free frame in MEMSWP */
-      if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) < 0) {
-        printf("Current active swap doesn't have any free frame\n"); fflush(stdout);
-        int i;
-        for (i = 0; i < PAGING_MAX_MMSWP; i++) {
-          if (MEMPHY_get_freefp(caller->mswp[i], &swpfpn) == 0) {
-            caller->active_mswp = (struct memphy_struct *)&caller->mswp[i];
-            index_of_active_mswp = i;
-            break;
-          }
-        }
-        if (i == PAGING_MAX_MMSWP) {
-          #ifdef SYNC
-            pthread_mutex_unlock(&MEM_in_use);
-          #endif
-          return -3000; // MEMSWAP doesn't have any free frame
-        }
-      }
+/*pg_getwpage - get the page in ram for writing
+ *@mm: memory region
+ *@pagenum: PGN
+ *@framenum: return FPN
+ *@caller: caller
+ *
+ *A page shared copy-on-write gets a private copy of its frame first,
+ *unless every other mapper already left it.
+ */
+static int pg_getwpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+  uint32_t *pte = &mm->pgd[pgn];
+  struct framephy_struct *frm = NULL;
+  int oldfpn;
+
+  /* The PTE is read again under the lock, another CPU may have
+   * evicted the page since pg_getpage() */
+  for (;;) {
+    if (pg_getpage(mm, pgn, fpn, caller) != 0)
+      return -1;
+#ifdef SYNC
+    pthread_mutex_lock(&MEM_in_use);
+#endif
+    if (PAGING_PTE_PAGE_PRESENT(*pte))
+      break;
+#ifdef SYNC
+    pthread_mutex_unlock(&MEM_in_use);
+#endif
+  }
+  if (!PAGING_PTE_PAGE_COW(*pte)) {
+    *fpn = PAGING_PTE_FPN(*pte);
+#ifdef SYNC
+    pthread_mutex_unlock(&MEM_in_use);
+#endif
+    return 0;
+  }
 
-      /* Copy victim frame to swap */
-      printf("\tCopy fpn=%d to swpfpn=%d\n", vicfpn, swpfpn); fflush(stdout);
-      __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-      /* Update page table */
-      pte_set_swap(&mm->pgd[vicpgn], index_of_active_mswp, swpfpn);
+  oldfpn = PAGING_PTE_FPN(*pte);
+  if (MEMPHY_get_ref(caller->mram, oldfpn) == 0) {
+    /* Last mapper, the frame is private again */
+    CLRBIT(*pte, PAGING_PTE_COW_MASK);
+  }
+  else {
+    /* A shared frame is never a victim, so it stays put while the
+     * new frame is obtained */
+    if (alloc_pages_range(caller, 1, &frm) < 0) {
+#ifdef SYNC
+      pthread_mutex_unlock(&MEM_in_use);
+#endif
+      return -1;
     }
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy target frame from swap to mem */
-    __swap_cp_page((struct memphy_struct *)&caller->mswp[swptyp], swpoff, caller->mram, vicfpn);
-    MEMPHY_put_freefp((struct memphy_struct *)&caller->mswp[swptyp], swpoff);
-
-    pte_set_fpn(&pte, vicfpn);
-    pte_set_fpn(&mm->pgd[pgn], vicfpn);
-    enlist_pgn_node(&caller->mm->fifo_pgn,pgn);
+    __swap_cp_page(caller->mram, oldfpn, caller->mram, frm->fpn);
+    MEMPHY_unref(caller->mram, oldfpn);
+    pte_set_fpn(pte, frm->fpn);
+    PERF_INC(caller, cowcopy);
+#ifdef RAM_STATUS_DUMP
+    printf(ANSI_COLOR_PINK "[Copy on write]\tPID #%d:\tPGN:%d\tShared FPN:%d\tNew FPN:%d\n" ANSI_COLOR_RESET,
+           caller->pid, pgn, oldfpn, frm->fpn);
+#endif
+    free(frm);
   }
-
-  *fpn = PAGING_PTE_FPN(pte);
-  #ifdef SYNC
-    pthread_mutex_unlock(&MEM_in_use);
-  #endif
-  #endif
+  *fpn = PAGING_PTE_FPN(*pte);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
+#ifdef LRU
+  add_LRU_page(pte, pgn);
+  PERF_INC(caller, lru_update);
+#endif
   return 0;
 }
 
@@ -416,7 +451,7 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller,
   int off = PAGING_OFFST(addr);
   int fpn, phyaddr;
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
+  if(pg_getwpage(mm, pgn, &fpn, caller) != 0) 
     return -1; /* invalid page access */
   if (vmaid == 0) {
     phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
@@ -424,7 +459,8 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller,
   else { // vmaid = 1
     phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + (PAGING_PAGESZ - 1 - off);
   }
-  MEMPHY_write(caller->mram,phyaddr, value);
+  if (MEMPHY_write(caller->mram, phyaddr, value) < 0)
+    return -1;
   return 0;
 }
 
@@ -462,71 +498,15 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 
     *alloc_addr = rgnode.rg_start;
     #ifdef LRU
-    if (vmaid == 0) {
-      for (int i = rgnode.rg_start / 256; i <= rgnode.rg_end / 256; i++)
+    /* A reused region may have been swapped out, bring it back */
+    {
+      int pgn_lo = PAGING_PGN(vmaid == 0 ? rgnode.rg_start : rgnode.rg_end);
+      int pgn_hi = PAGING_PGN(vmaid == 0 ? rgnode.rg_end : rgnode.rg_start);
+      for (int i = pgn_lo; i <= pgn_hi; i++)
       {
-        uint32_t current_pte = caller->mm->pgd[i];
-        if (!PAGING_PTE_PAGE_PRESENT(current_pte))
-        {
-          printf("FREE REGION in SWAP \n\n");
-          int tgtfpn = PAGING_PTE_FPN(current_pte);
-          uint32_t* vicpte;
-          int vicfpn, swpfpn, vicpgn;
-
-          find_LRU_victim_page(&vicpgn, &vicfpn, &vicpte);
-          if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) < 0)
-          {
-            printf("Out of SWAP");
-            return -3000;
-          }
-          __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-          /* Find index of active memswap */
-          int index_of_active_mswp;
-          for (index_of_active_mswp = 0; index_of_active_mswp < PAGING_MAX_MMSWP; index_of_active_mswp++) {
-            if ((struct memphy_struct *)&caller->mswp[index_of_active_mswp] == caller->active_mswp) break;
-          }
-          pte_set_swap(vicpte, index_of_active_mswp, swpfpn);
-          __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
-          pte_set_fpn(&caller->mm->pgd[i], vicfpn);
-
-          add_LRU_page(&caller->mm->pgd[i], i);
-          MEMPHY_put_freefp(caller->active_mswp, tgtfpn);
-        }
-        update_LRU_lst(&current_pte);
-      }
-    }
-    else {
-      for (int i = rgnode.rg_start / 256; i >= rgnode.rg_end / 256; i--)
-      {
-        uint32_t current_pte = caller->mm->pgd[i];
-        if (!PAGING_PTE_PAGE_PRESENT(current_pte))
-        {
-          printf("FREE REGION in SWAP \n\n");
-          int tgtfpn = PAGING_PTE_FPN(current_pte);
-          uint32_t* vicpte;
-          int vicfpn, swpfpn, vicpgn;
-
-          find_LRU_victim_page(&vicpgn, &vicfpn, &vicpte);
-
-          if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) < 0)
-          {
-            printf("Out of SWAP");
-            return -3000;
-          }
-          __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-          /* Find index of avtive memswap */
-          int index_of_active_mswp;
-          for (index_of_active_mswp = 0; index_of_active_mswp < PAGING_MAX_MMSWP; index_of_active_mswp++) {
-            if ((struct memphy_struct *)&caller->mswp[index_of_active_mswp] == caller->active_mswp) break;
-          }
-          pte_set_swap(vicpte, index_of_active_mswp, swpfpn);
-          __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
-          pte_set_fpn(&caller->mm->pgd[i], vicfpn);
-
-          add_LRU_page(&caller->mm->pgd[i], i);
-          MEMPHY_put_freefp(caller->active_mswp, tgtfpn);
-        }
-        update_LRU_lst(&current_pte);
+        int fpn;
+        if (pg_getpage(caller->mm, i, &fpn, caller) < 0)
+          return -1;
       }
     }
     #endif
@@ -713,6 +693,21 @@ int __free(struct pcb_t *caller, int rgid)
     return -1;
   }
 
+  /* A shared segment is only unmapped, its content stays */
+#ifdef SYNC
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  int shared = shm_detach(caller->mm, rgid);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
+  if (shared) {
+    free(freergnode);
+    rgnode->rg_start = 0;
+    rgnode->rg_end = 0;
+    return 0;
+  }
+
   // deep copy rgnode to freergnode
   freergnode->rg_start = rgnode->rg_start;
   freergnode->rg_end = rgnode->rg_end;
@@ -774,10 +769,19 @@ int __free(struct pcb_t *caller, int rgid)
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
   int addr;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
   int val = __alloc(proc, 0, reg_index, size, &addr);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
   if (val < 0) {
     printf(ANSI_COLOR_RED "\tAlloc FAILED\n" ANSI_COLOR_RESET);
   }
+  else {
+    PERF_INC(proc, alloc[perf_szclass(size)]);
+  }
   return val;
 }
 
@@ -789,11 +793,18 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
   int addr;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
   int val = __alloc(proc, 1, reg_index, size, &addr);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
   if (val < 0) {
     printf(ANSI_COLOR_RED "\tAlloc FAILED\n" ANSI_COLOR_RESET);
     return val;
   }
+  PERF_INC(proc, alloc[perf_szclass(size)]);
   return val;
 }
 
@@ -805,7 +816,79 @@ int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
 {
-  return __free(proc, reg_index);
+  int val;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
+  struct vm_rg_struct *rgnode = get_symrg_byid(proc->mm, reg_index);
+
+  /* Account the region size before __free() clears it */
+  if (rgnode != NULL && rgnode->rg_start != rgnode->rg_end) {
+    PERF_INC(proc, free[perf_szclass((rgnode->vmaid == 0)
+                                     ? rgnode->rg_end - rgnode->rg_start + 1
+                                     : rgnode->rg_start - rgnode->rg_end + 1)]);
+  }
+  val = __free(proc, reg_index);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  return val;
+}
+
+/*pgshmget - PAGING-based create a shared memory segment
+ *@proc: Process executing the instruction
+ *@key: key of the segment
+ *@size: segment size
+ */
+int pgshmget(struct pcb_t *proc, uint32_t key, uint32_t size)
+{
+#ifdef SYNC
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  int val = shm_get(proc, key, size);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
+  if (val < 0)
+    printf(ANSI_COLOR_RED "\tShmget FAILED\n" ANSI_COLOR_RESET);
+#ifdef IODUMP
+  printf(ANSI_COLOR_PINK "shmget key=%d size=%d\n" ANSI_COLOR_RESET, key, size);
+#endif
+  return val;
+}
+
+/*pgshmat - PAGING-based map a shared memory segment
+ *@proc: Process executing the instruction
+ *@key: key of the segment
+ *@reg_index: memory region ID the segment is mapped as
+ */
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t reg_index)
+{
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  int val = shm_attach(proc, key, reg_index);
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  if (val < 0)
+    printf(ANSI_COLOR_RED "\tShmat FAILED\n" ANSI_COLOR_RESET);
+#ifdef IODUMP
+  printf(ANSI_COLOR_PINK "shmat key=%d region=%d\n" ANSI_COLOR_RESET, key, reg_index);
+#ifdef PAGETBL_DUMP
+  print_pgtbl(proc, 0, -1);
+#endif
+#endif
+#ifdef RAM_STATUS_DUMP
+#ifdef LRU
+  print_LRU_page();
+#else
+  print_list_pgn(proc->mm->fifo_pgn);
+#endif
+#endif
+  return val;
 }
 
 
@@ -843,6 +926,8 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller,
 int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+  if (currg == NULL)
+    return -1;
   int vmaid = currg->vmaid;
 
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
@@ -870,12 +955,14 @@ int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data)
     pg_getval(caller->mm, currg->rg_start + offset, data, caller, vmaid);
     #ifdef LRU
     update_LRU_lst(&caller->mm->pgd[PAGING_PGN((currg->rg_start + offset))]);
+    PERF_INC(caller, lru_update);
     #endif
   }
   else { // vmaid = 1
     pg_getval(caller->mm, currg->rg_start - offset, data, caller, vmaid);
     #ifdef LRU
     update_LRU_lst(&caller->mm->pgd[PAGING_PGN((currg->rg_start - offset))]);
+    PERF_INC(caller, lru_update);
     #endif
   }
   return 0;
@@ -891,7 +978,14 @@ int pgread(
 {
   BYTE data;
 
-  int val = __read(proc, source, offset, &data);
+  int val;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
+  val = __read(proc, source, offset, &data);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
   destination = (uint32_t) data;
   #ifdef IODUMP
   if (val == 0)
@@ -923,6 +1017,8 @@ int pgread(
 int __write(struct pcb_t *caller, int rgid, int offset, BYTE value)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+  if (currg == NULL)
+    return -1;
   int vmaid = currg->vmaid;
 
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
@@ -949,12 +1045,14 @@ int __write(struct pcb_t *caller, int rgid, int offset, BYTE value)
     pg_setval(caller->mm, currg->rg_start + offset, value, caller, 0);
     #ifdef LRU
     update_LRU_lst(&caller->mm->pgd[PAGING_PGN((currg->rg_start + offset))]);
+    PERF_INC(caller, lru_update);
     #endif
   }
   else { // vmaid = 1
     pg_setval(caller->mm, currg->rg_start - offset, value, caller, 1);
     #ifdef LRU
     update_LRU_lst(&caller->mm->pgd[PAGING_PGN((currg->rg_start - offset))]);
+    PERF_INC(caller, lru_update);
     #endif
   }
   return 0;
@@ -967,7 +1065,14 @@ int pgwrite(
 		uint32_t destination, // Index of destination register
 		uint32_t offset)
 {
-  int val = __write(proc, destination, offset, data);
+  int val;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
+  val = __write(proc, destination, offset, data);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
   #ifdef IODUMP
     printf(ANSI_COLOR_PINK "write region=%d offset=%d value=%d\n" ANSI_COLOR_RESET, destination, offset, data);
   #ifdef PAGETBL_DUMP
@@ -984,31 +1089,626 @@ int pgwrite(
   return val;
 }
 
+/*get_valid_rg - get a region memory checked for a block access
+ *@caller: caller
+ *@rgid: memory region ID (used to identify variable in symbole table)
+ *@offset: offset of the first byte of the block in the region
+ *@len: number of bytes in the block
+ *
+ */
+static struct vm_rg_struct *get_valid_rg(struct pcb_t *caller, int rgid, int offset, int len)
+{
+  struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+
+  if (currg == NULL || offset < 0 || len <= 0)
+    return NULL;
+
+  if (currg->rg_start == currg->rg_end)
+    return NULL; /* Region is not allocated */
+
+  long last = (long)offset + len - 1;
+  if (currg->vmaid == 0) {
+    if ((long)currg->rg_start + last > (long)currg->rg_end)
+      return NULL; // block out of region range
+  }
+  else { // vmaid = 1
+    if ((long)currg->rg_start - last < (long)currg->rg_end)
+      return NULL; // block out of region range
+  }
+  return currg;
+}
 
-/*free_pcb_memphy - collect all memphy of pcb
+/*pg_getspan - bring in the page holding a byte of a region memory
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
+ *@currg: memory region
+ *@offset: offset to acess in memory region
+ *@phyaddr: return the MEMRAM address of the byte
+ *@wr: non-zero if the page is about to be written
+ *
+ *Return the number of bytes from @offset on that sit contiguously in the
+ *same frame, or -1 on invalid page access.
+ */
+static int pg_getspan(struct pcb_t *caller, struct vm_rg_struct *currg, int offset, int *phyaddr, int wr)
+{
+  int addr = (currg->vmaid == 0) ? currg->rg_start + offset : currg->rg_start - offset;
+  int pgn = PAGING_PGN(addr);
+  int off = PAGING_OFFST(addr);
+  int fpn;
+
+  /* Get the page to MEMRAM, swap from MEMSWAP if needed */
+  int ret = wr ? pg_getwpage(caller->mm, pgn, &fpn, caller)
+               : pg_getpage(caller->mm, pgn, &fpn, caller);
+  if (ret != 0)
+    return -1; /* invalid page access */
+
+  if (currg->vmaid == 0) {
+    *phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
+    return PAGING_PAGESZ - off;
+  }
+  /* Heap frames are mirrored, walking down the region walks up the frame */
+  *phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + (PAGING_PAGESZ - 1 - off);
+  return off + 1;
+}
+
+/*pg_rwblock - move a block between a region memory and a buffer
+ *@caller: caller
+ *@currg: memory region
+ *@offset: offset of the first byte of the block in the region
+ *@buf: buffer to read into or write from
+ *@len: number of bytes in the block
+ *@wr: non-zero to write the buffer into the region
+ *
+ *Each page is resolved once and moved with a single block access.
+ */
+static int pg_rwblock(struct pcb_t *caller, struct vm_rg_struct *currg, int offset,
+                      BYTE *buf, int len, int wr)
+{
+  while (len > 0) {
+    int phyaddr;
+    int n = pg_getspan(caller, currg, offset, &phyaddr, wr);
+    if (n < 0)
+      return -1;
+    if (n > len)
+      n = len;
+
+    if (wr)
+      MEMPHY_write_buf(caller->mram, phyaddr, buf, n);
+    else
+      MEMPHY_read_buf(caller->mram, phyaddr, buf, n);
+
+    offset += n;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*__fill - set a block of a region memory to a value
+ *@caller: caller
+ *@rgid: memory region ID (used to identify variable in symbole table)
+ *@offset: offset of the first byte of the block in the region
+ *@len: number of bytes in the block
+ *@value: value
+ *
+ */
+int __fill(struct pcb_t *caller, int rgid, int offset, int len, BYTE value)
+{
+  struct vm_rg_struct *currg = get_valid_rg(caller, rgid, offset, len);
+
+  if (currg == NULL) {
+    printf("\tFill invalid range\n");
+    return -1;
+  }
+
+  while (len > 0) {
+    int phyaddr;
+    int n = pg_getspan(caller, currg, offset, &phyaddr, 1);
+    if (n < 0)
+      return -1;
+    if (n > len)
+      n = len;
+
+    MEMPHY_fill(caller->mram, phyaddr, value, n);
+
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*__copy - copy a block between region memories
+ *@caller: caller
+ *@srcid: source memory region ID
+ *@srcoff: offset of the block in the source region
+ *@dstid: destination memory region ID
+ *@dstoff: offset of the block in the destination region
+ *@len: number of bytes in the block
+ *
+ */
+int __copy(struct pcb_t *caller, int srcid, int srcoff, int dstid, int dstoff, int len)
+{
+  struct vm_rg_struct *srcrg = get_valid_rg(caller, srcid, srcoff, len);
+  struct vm_rg_struct *dstrg = get_valid_rg(caller, dstid, dstoff, len);
+  BYTE buf[PAGING_PAGESZ];
+
+  if (srcrg == NULL || dstrg == NULL) {
+    printf("\tCopy invalid range\n");
+    return -1;
+  }
+
+  /* Bringing in the destination page may swap out the source page, so
+   * each chunk goes through a bounce buffer. An overlapping copy towards
+   * higher offsets runs backward, like memmove */
+  int backward = (srcid == dstid && dstoff > srcoff);
+  int done = 0;
+  while (done < len) {
+    int n = (len - done < PAGING_PAGESZ) ? len - done : PAGING_PAGESZ;
+    int pos = backward ? len - done - n : done;
+
+    if (pg_rwblock(caller, srcrg, srcoff + pos, buf, n, 0) < 0 ||
+        pg_rwblock(caller, dstrg, dstoff + pos, buf, n, 1) < 0)
+      return -1;
+
+    done += n;
+  }
+  return 0;
+}
+
+/*pgfill - PAGING-based fill a block of a region memory */
+int pgfill(
+		struct pcb_t * proc, // Process executing the instruction
+		BYTE data, // Data to be written into every byte of the block
+		uint32_t destination, // Index of destination region
+		uint32_t offset, // Block start = [destination] + [offset]
+		uint32_t length) // Number of bytes in the block
+{
+  int val;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
+  val = __fill(proc, destination, offset, length, data);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  #ifdef IODUMP
+  if (val == 0)
+    printf(ANSI_COLOR_PINK "Process %d fill region=%d offset=%d length=%d value=%d\n" ANSI_COLOR_RESET, proc->pid, destination, offset, length, data);
+  else
+    printf(ANSI_COLOR_RED "Process %d error when fill region=%d offset=%d length=%d" ANSI_COLOR_RESET "\n", proc->pid, destination, offset, length);
+  #ifdef PAGETBL_DUMP
+    print_pgtbl(proc, 0, -1);
+  #endif
+  #endif
+  #ifdef RAM_STATUS_DUMP
+  #ifdef LRU
+  print_LRU_page();
+  #else
+  print_list_pgn(proc->mm->fifo_pgn);
+  #endif
+  #endif
+  return val;
+}
+
+/*pgcopy - PAGING-based copy a block between region memories */
+int pgcopy(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source region
+		uint32_t srcoff, // Source block start = [source] + [srcoff]
+		uint32_t destination, // Index of destination region
+		uint32_t dstoff, // Destination block start = [destination] + [dstoff]
+		uint32_t length) // Number of bytes in the block
+{
+  int val;
+#ifdef SYNC
+  pthread_mutex_lock(&proc->mm->lock);
+#endif
+  val = __copy(proc, source, srcoff, destination, dstoff, length);
+#ifdef SYNC
+  pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  #ifdef IODUMP
+  if (val == 0)
+    printf(ANSI_COLOR_PINK "Process %d copy region=%d offset=%d to region=%d offset=%d length=%d\n" ANSI_COLOR_RESET, proc->pid, source, srcoff, destination, dstoff, length);
+  else
+    printf(ANSI_COLOR_RED "Process %d error when copy region=%d offset=%d to region=%d offset=%d length=%d" ANSI_COLOR_RESET "\n", proc->pid, source, srcoff, destination, dstoff, length);
+  #ifdef PAGETBL_DUMP
+    print_pgtbl(proc, 0, -1);
+  #endif
+  #endif
+  #ifdef RAM_STATUS_DUMP
+  #ifdef LRU
+  print_LRU_page();
+  #else
+  print_list_pgn(proc->mm->fifo_pgn);
+  #endif
+  #endif
+  return val;
+}
+
+/*pg_rwword - move a word between a region memory and a buffer
+ *@caller: caller
+ *@currg: memory region
+ *@offset: offset of the first byte of the word in the region
+ *@bytes: word bytes, least significant first
+ *@width: word width in bytes
+ *@wr: non-zero to write the word into the region
+ *
+ */
+static int pg_rwword(struct pcb_t *caller, struct vm_rg_struct *currg, int offset,
+                     BYTE *bytes, int width, int wr)
+{
+  int phyaddr;
+  int n = pg_getspan(caller, currg, offset, &phyaddr, wr);
+
+  if (n < 0)
+    return -1;
+
+  /* Fast path: the word sits in one frame, translated once */
+  if (n >= width) {
+    if (wr)
+      return MEMPHY_write_buf(caller->mram, phyaddr, bytes, width);
+    return MEMPHY_read_buf(caller->mram, phyaddr, bytes, width);
+  }
+
+  /* The word straddles a page boundary, move it piecewise */
+  return pg_rwblock(caller, currg, offset, bytes, width, wr);
+}
+
+/*__load - read a little-endian word in region memory
+ *@caller: caller
+ *@rgid: memory region ID (used to identify variable in symbole table)
+ *@offset: offset to acess in memory region
+ *@width: word width in bytes (4 or 8)
+ *@value: obtained value
+ *
+ */
+int __load(struct pcb_t *caller, int rgid, int offset, int width, uint64_t *value)
+{
+  struct vm_rg_struct *currg = get_valid_rg(caller, rgid, offset, width);
+  BYTE bytes[sizeof(uint64_t)];
+
+  if (currg == NULL || width > (int)sizeof(uint64_t))
+    return -1;
+
+  if (pg_rwword(caller, currg, offset, bytes, width, 0) < 0)
+    return -1;
+
+  *value = 0;
+  for (int i = width - 1; i >= 0; i--)
+    *value = (*value << 8) | (uint8_t)bytes[i];
+  return 0;
+}
+
+/*__store - write a little-endian word in region memory
+ *@caller: caller
+ *@rgid: memory region ID (used to identify variable in symbole table)
+ *@offset: offset to acess in memory region
+ *@width: word width in bytes (4 or 8)
+ *@value: value
+ *
+ */
+int __store(struct pcb_t *caller, int rgid, int offset, int width, uint64_t value)
+{
+  struct vm_rg_struct *currg = get_valid_rg(caller, rgid, offset, width);
+  BYTE bytes[sizeof(uint64_t)];
+
+  if (currg == NULL || width > (int)sizeof(uint64_t))
+    return -1;
+
+  for (int i = 0; i < width; i++)
+    bytes[i] = (BYTE)(value >> (8 * i));
+
+  return pg_rwword(caller, currg, offset, bytes, width, 1);
+}
+
+/*pgload - PAGING-based load a word of a region memory to registers
+ * A 64-bit word fills the register pair [destination], [destination + 1]
+ * low word first.
+ */
+int pgload(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source region
+		uint32_t offset, // Source address = [source] + [offset]
+		uint32_t destination, // Index of destination register
+		int width) // Access width in bytes, 4 or 8
+{
+  uint64_t data = 0;
+  int nregs = (width > 4) ? 2 : 1;
+  int val = -1;
+
+  if (destination + nregs <= NUM_REGS)
+#ifdef SYNC
+    pthread_mutex_lock(&proc->mm->lock);
+#endif
+    val = __load(proc, source, offset, width, &data);
+#ifdef SYNC
+    pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  if (val == 0) {
+    proc->regs[destination] = (addr_t)data;
+    if (nregs > 1)
+      proc->regs[destination + 1] = (addr_t)(data >> 32);
+  }
+  #ifdef IODUMP
+  if (val == 0)
+    printf(ANSI_COLOR_PINK "Process %d load%d region=%d offset=%d value=%llu\n" ANSI_COLOR_RESET, proc->pid, width * 8, source, offset, (unsigned long long)data);
+  else
+    printf(ANSI_COLOR_RED "Process %d error when load%d region=%d offset=%d" ANSI_COLOR_RESET "\n", proc->pid, width * 8, source, offset);
+  #ifdef PAGETBL_DUMP
+    print_pgtbl(proc, 0, -1);
+  #endif
+  #endif
+  #ifdef RAM_STATUS_DUMP
+  #ifdef LRU
+  print_LRU_page();
+  #else
+  print_list_pgn(proc->mm->fifo_pgn);
+  #endif
+  #endif
+  return val;
+}
+
+/*pgstore - PAGING-based store registers to a word of a region memory
+ * A 64-bit word is taken from the register pair [source], [source + 1]
+ * low word first.
+ */
+int pgstore(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source register
+		uint32_t destination, // Index of destination region
+		uint32_t offset, // Destination address = [destination] + [offset]
+		int width) // Access width in bytes, 4 or 8
+{
+  uint64_t data = 0;
+  int nregs = (width > 4) ? 2 : 1;
+  int val = -1;
+
+  if (source + nregs <= NUM_REGS) {
+    data = proc->regs[source];
+    if (nregs > 1)
+      data |= (uint64_t)proc->regs[source + 1] << 32;
+#ifdef SYNC
+    pthread_mutex_lock(&proc->mm->lock);
+#endif
+    val = __store(proc, destination, offset, width, data);
+#ifdef SYNC
+    pthread_mutex_unlock(&proc->mm->lock);
+#endif
+  }
+  #ifdef IODUMP
+  if (val == 0)
+    printf(ANSI_COLOR_PINK "Process %d store%d region=%d offset=%d value=%llu\n" ANSI_COLOR_RESET, proc->pid, width * 8, destination, offset, (unsigned long long)data);
+  else
+    printf(ANSI_COLOR_RED "Process %d error when store%d region=%d offset=%d" ANSI_COLOR_RESET "\n", proc->pid, width * 8, destination, offset);
+  #ifdef PAGETBL_DUMP
+    print_pgtbl(proc, 0, -1);
+  #endif
+  #endif
+  #ifdef RAM_STATUS_DUMP
+  #ifdef LRU
+  print_LRU_page();
+  #else
+  print_list_pgn(proc->mm->fifo_pgn);
+  #endif
+  #endif
+  return val;
+}
+
+
+/*pg_forkpte - share or copy a page of the parent with the child
+ *@caller: parent
+ *@pte: parent page table entry
+ *@cpte: child page table entry
+ *
+ *A page in RAM is shared copy-on-write. A swapped page gets its own
+ *swap frame, so swapping it in later never involves the other process.
+ */
+static int pg_forkpte(struct pcb_t *caller, uint32_t *pte, uint32_t *cpte)
+{
+  if (PAGING_PTE_PAGE_PRESENT(*pte)) {
+    MEMPHY_ref(caller->mram, PAGING_PTE_FPN(*pte));
+    SETBIT(*pte, PAGING_PTE_COW_MASK);
+    *cpte = *pte;
+    return 0;
+  }
+  if (!PAGING_PTE_PAGE_SWAPPED(*pte))
+    return 0;
+  if (PAGING_PTE_PAGE_ZERO(*pte)) {
+    *cpte = *pte;
+    return 0;
+  }
+
+  int swptyp, swpfpn;
+  if (pg_getswpfp(caller, &swptyp, &swpfpn) < 0)
+    return -1;
+  /* The parent page may still be queued for writing */
+  swapio_copy(get_swpdev(caller, PAGING_SWPTYP(*pte)), PAGING_SWPOFF(*pte),
+              get_swpdev(caller, swptyp), swpfpn);
+  pte_set_swap(cpte, swptyp, swpfpn);
+  return 0;
+}
+
+/*pg_forkundo - release what pg_forkpte took for a child page
+ *@caller: parent
+ *@cpte: child page table entry
+ */
+static void pg_forkundo(struct pcb_t *caller, uint32_t cpte)
+{
+  if (PAGING_PTE_PAGE_PRESENT(cpte))
+    MEMPHY_unref(caller->mram, PAGING_PTE_FPN(cpte));
+  else if (PAGING_PTE_PAGE_SWAPPED(cpte) && !PAGING_PTE_PAGE_ZERO(cpte))
+    swapio_release(get_swpdev(caller, PAGING_SWPTYP(cpte)), PAGING_SWPOFF(cpte));
+}
+
+/*__fork - clone the memory of a process copy-on-write
+ *@caller: parent
+ *@child: child, gets a new mm sharing the parent frames
+ *
+ */
+int __fork(struct pcb_t *caller, struct pcb_t *child)
+{
+  struct mm_struct *mm = caller->mm;
+  struct mm_struct *cmm = malloc(sizeof(struct mm_struct));
+  struct vm_area_struct *vma, **cvma = &cmm->mmap;
+  struct pgn_t *pgit, **cpgit = &cmm->fifo_pgn;
+  int first[2], last[2]; /* Mapped pages of each vma, first >= last */
+  int vmaid, pgn, ret = 0;
+
+  cmm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  cmm->mm_users = 1;
+  pthread_mutex_init(&cmm->lock, NULL);
+#ifdef SYNC
+  pthread_mutex_lock(&mm->lock);
+#endif
+  memcpy(cmm->symrgtbl, mm->symrgtbl, sizeof(mm->symrgtbl));
+
+  for (vma = mm->mmap; vma != NULL; vma = vma->vm_next) {
+    struct vm_area_struct *nvma = malloc(sizeof(struct vm_area_struct));
+    struct vm_rg_struct *rgit, **nrgit = &nvma->vm_freerg_list;
+
+    *nvma = *vma;
+    nvma->vm_mm = cmm;
+    for (rgit = vma->vm_freerg_list; rgit != NULL; rgit = rgit->rg_next) {
+      *nrgit = init_vm_rg(rgit->rg_start, rgit->rg_end, rgit->vmaid);
+      nrgit = &(*nrgit)->rg_next;
+    }
+    *cvma = nvma;
+    cvma = &nvma->vm_next;
+  }
+  *cvma = NULL;
+
+  /* Stack pages grow up from 0, heap pages grow down from vmemsz */
+  vma = get_vma_by_num(mm, 0);
+  first[0] = (int)PAGING_PGN(vma->vm_end) - 1;
+  last[0] = 0;
+#ifdef MM_PAGING_HEAP_GODOWN
+  vma = get_vma_by_num(mm, 1);
+  first[1] = (int)PAGING_PGN(vma->vm_start);
+  last[1] = (vma->vm_start == vma->vm_end) ? first[1] + 1 : (int)PAGING_PGN(vma->vm_end);
+#else
+  first[1] = -1;
+  last[1] = 0;
+#endif
+
+#ifdef SYNC
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  for (vmaid = 0; vmaid < 2 && ret == 0; vmaid++) {
+    for (pgn = first[vmaid]; pgn >= last[vmaid]; pgn--) {
+      /* Shared segments stay shared, the child attaches them below */
+      if (shm_attached(mm, pgn))
+        continue;
+      if (pg_forkpte(caller, &mm->pgd[pgn], &cmm->pgd[pgn]) < 0) {
+        ret = -1;
+        break;
+      }
+    }
+  }
+  if (ret < 0) {
+    /* Out of swap, give back the frames already shared or copied */
+    for (pgn = 0; pgn < PAGING_MAX_PGN; pgn++)
+      pg_forkundo(caller, cmm->pgd[pgn]);
+  }
+  else {
+    shm_fork(mm, cmm);
+  }
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
+
+  if (ret < 0) {
+#ifdef SYNC
+    pthread_mutex_unlock(&mm->lock);
+#endif
+    printf(ANSI_COLOR_RED "ERROR: Out of SWAP. Fork Failed!\n" ANSI_COLOR_RESET);
+    return -1;
+  }
+
+  /* Both processes replace the same pages in the same order */
+  for (pgit = mm->fifo_pgn; pgit != NULL; pgit = pgit->pg_next) {
+    *cpgit = malloc(sizeof(struct pgn_t));
+    (*cpgit)->pgn = pgit->pgn;
+    cpgit = &(*cpgit)->pg_next;
+  }
+  *cpgit = NULL;
+#ifdef SYNC
+  pthread_mutex_unlock(&mm->lock);
+#endif
+
+  child->mm = cmm;
+  return 0;
+}
+
+/*__clone_vm - share the memory of a process with a new thread
+ *@caller: thread creating the new one
+ *@child: new thread
+ *
+ */
+int __clone_vm(struct pcb_t *caller, struct pcb_t *child)
+{
+  __sync_fetch_and_add(&caller->mm->mm_users, 1);
+  child->mm = caller->mm;
+  return 0;
+}
+
+/*free_pcb_memph - drop the reference of a thread to its memory
+ *@caller: caller, done with its memory
+ *
+ *The last thread of the mm gives back its frames, swap slots and
+ *shared segments, then frees the mm itself. A frame still shared
+ *copy-on-write only loses one mapper.
  */
 int free_pcb_memph(struct pcb_t *caller) {
-  int pagenum, fpn;
-  uint32_t pte;
+  struct mm_struct *mm = caller->mm;
+  struct vm_area_struct *vma;
+  struct vm_rg_struct *rg;
+  struct pgn_t *pg;
+  int pgn;
 
+  if (__sync_sub_and_fetch(&mm->mm_users, 1) > 0)
+    return 0;
 
-  for(pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++) {
-    pte= caller->mm->pgd[pagenum];
+#ifdef SYNC
+  pthread_mutex_lock(&MEM_in_use);
+#endif
+  shm_exit(mm);
+#ifdef LRU
+  free_LRU_pages(mm->pgd, PAGING_MAX_PGN);
+#endif
+  for (pgn = 0; pgn < PAGING_MAX_PGN; pgn++) {
+    uint32_t pte = mm->pgd[pgn];
 
-    if (!PAGING_PTE_PAGE_PRESENT(pte)) {
-      fpn = PAGING_PTE_FPN(pte);
-      MEMPHY_put_freefp(caller->mram, fpn);
-    } 
-    else {
-      int fpn = PAGING_PTE_SWP(pte);
-      fpn = PAGING_PTE_SWPOFF(pte) / PAGING_PAGESZ;
-      MEMPHY_put_freefp(caller->active_mswp, fpn);    
+    if (PAGING_PTE_PAGE_PRESENT(pte)) {
+      int fpn = PAGING_PTE_FPN(pte);
+      if (MEMPHY_get_ref(caller->mram, fpn) > 0)
+        MEMPHY_unref(caller->mram, fpn);
+      else
+        MEMPHY_put_freefp(caller->mram, fpn);
+    }
+    else if (PAGING_PTE_PAGE_SWAPPED(pte) && !PAGING_PTE_PAGE_ZERO(pte)) {
+      swapio_release(get_swpdev(caller, PAGING_SWPTYP(pte)), PAGING_SWPOFF(pte));
     }
   }
+#ifdef SYNC
+  pthread_mutex_unlock(&MEM_in_use);
+#endif
 
+  while ((pg = mm->fifo_pgn) != NULL) {
+    mm->fifo_pgn = pg->pg_next;
+    free(pg);
+  }
+  while ((vma = mm->mmap) != NULL) {
+    mm->mmap = vma->vm_next;
+    while ((rg = vma->vm_freerg_list) != NULL) {
+      vma->vm_freerg_list = rg->rg_next;
+      free(rg);
+    }
+    free(vma);
+  }
+  pthread_mutex_destroy(&mm->lock);
+  free(mm->pgd);
+  free(mm);
+  caller->mm = NULL;
   return 0;
 }
 
@@ -1059,7 +1759,7 @@ int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int
       vma = vma->vm_next;
       continue; 
     } 
-    if ((((int)vma->vm_start-vmastart)*(vmaend-(int)vma->vm_end)) >= 0) {
+    if (((long)vma->vm_start - vmastart) * ((long)vmaend - (long)vma->vm_end) >= 0) {
       if (vmaend != vma->vm_end) {     
         printf(ANSI_COLOR_RED "ERROR: Memory overlap detected!: ");
         printf("[%ld - %ld] and [%d - %d]\n\n" ANSI_COLOR_RESET, vma->vm_start, vma->vm_end, vmastart, vmaend);
@@ -1123,37 +1823,39 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int* inc_limit_re
 }
 
 /*find_victim_page - find victim page
- *@caller: caller
+ *@mm: memory region
+ *@mram: RAM the victim frame lives in
  *@pgn: return page number
  *
  */
-int find_victim_page(struct mm_struct *mm, int *retpgn) 
+int find_victim_page(struct mm_struct *mm, struct memphy_struct *mram, int *retpgn) 
 {
-  struct pgn_t *pg = mm->fifo_pgn;
+  struct pgn_t **pg, **victim = NULL;
 
   /* TODO: Implement the theorical mechanism to find the victim page */
-  // Use FIFO replacement policy
-  if (!pg)
-        return -1; // not important, can return any number
-
-  if (!pg->pg_next)
+  // Use FIFO replacement policy: the oldest page sits at the tail.
+  // Frames shared copy-on-write stay in memory
+  for (pg = &mm->fifo_pgn; *pg != NULL; )
   {
-      *retpgn = pg->pgn;
-      mm->fifo_pgn = NULL;
-      free(pg);
-      return 0;
-  }
-
-  struct pgn_t *prev_Page;
-  while (pg->pg_next)
-  {
-      prev_Page = pg;
-      pg = pg->pg_next;
+      uint32_t pte = mm->pgd[(*pg)->pgn];
+      if (!PAGING_PTE_PAGE_PRESENT(pte)) {
+          /* Stale node, a shared page was swapped out by another mapper */
+          struct pgn_t *stale = *pg;
+          *pg = stale->pg_next;
+          free(stale);
+          continue;
+      }
+      if (MEMPHY_get_ref(mram, PAGING_PTE_FPN(pte)) == 0)
+          victim = pg;
+      pg = &(*pg)->pg_next;
   }
+  if (victim == NULL)
+        return -1; // not important, can return any number
 
-  *retpgn = pg->pgn;
-  prev_Page->pg_next = NULL;
-  free(pg);
+  struct pgn_t *vic = *victim;
+  *retpgn = vic->pgn;
+  *victim = vic->pg_next;
+  free(vic);
   return 0;
 }
 
@@ -0,0 +1,326 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Compressed swap module mm/mm-zram.c
+ *
+ * A compressed swap keeps each of its frames as a small blob instead
+ * of a flat page. A page with every byte alike is kept as that byte
+ * alone, any other page is compressed with a byte-oriented LZ coder
+ * and stored raw when it does not shrink. Blobs come from a pool of
+ * size classes carved out of slabs, so storing and dropping pages
+ * does not go through malloc.
+ *
+ * All functions expect the mutex of the device to be held.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ZRAM_CLASS     16   // Size class granularity of the pool
+#define ZRAM_SLAB      4096 // Bytes carved at once into blocks of a class
+#define ZRAM_HASH      256  // Entries of the match finder
+#define ZRAM_MINMATCH  3
+#define ZRAM_MAXMATCH  (0x7f + ZRAM_MINMATCH)
+#define ZRAM_MAXLIT    0x80
+
+struct zslot_t {
+  BYTE *data;    // Blob in the pool, NULL for a same-filled page
+  uint32_t len;  // Blob size, the page size for a raw page
+  BYTE fill;     // Every byte of a same-filled page
+};
+
+struct zram_struct {
+  int pagesz;
+  int nslots;
+  struct zslot_t *slot;
+  int nclass;
+  void **freeblk;    // Free blocks of each class, linked through their first word
+  size_t pool_bytes; // Bytes taken by the slabs
+  size_t zbytes;     // Bytes of the blobs in use
+  size_t zpeak;      // Most bytes of blobs in use at once
+  /* Totals over the run */
+  unsigned long nstored; // Pages stored
+  unsigned long nsame;   // Pages stored as a single byte
+  unsigned long zstored; // Bytes the stored pages took
+};
+
+static void *zpool_alloc(struct zram_struct *z, uint32_t len)
+{
+  int c = (len + ZRAM_CLASS - 1) / ZRAM_CLASS - 1;
+  int bsz = (c + 1) * ZRAM_CLASS;
+  void *blk;
+
+  if (z->freeblk[c] == NULL) {
+    /* Carve a new slab, slabs are kept until the simulation ends */
+    int nblk = ZRAM_SLAB / bsz, i;
+    BYTE *slab;
+
+    if (nblk == 0)
+      nblk = 1;
+    slab = malloc((size_t)nblk * bsz);
+    if (slab == NULL)
+      return NULL;
+    z->pool_bytes += (size_t)nblk * bsz;
+    for (i = nblk - 1; i >= 0; i--) {
+      *(void **)(slab + i * bsz) = z->freeblk[c];
+      z->freeblk[c] = slab + i * bsz;
+    }
+  }
+  blk = z->freeblk[c];
+  z->freeblk[c] = *(void **)blk;
+  return blk;
+}
+
+static void zpool_free(struct zram_struct *z, void *blk, uint32_t len)
+{
+  int c = (len + ZRAM_CLASS - 1) / ZRAM_CLASS - 1;
+
+  *(void **)blk = z->freeblk[c];
+  z->freeblk[c] = blk;
+}
+
+/*
+ * zram_compress - LZ-compress a page
+ * A token is a byte c, followed by c + 1 literal bytes when c < 0x80,
+ * else by the 2-byte offset of a match of (c & 0x7f) + ZRAM_MINMATCH
+ * bytes.
+ *
+ * Return the compressed size, -1 if it would exceed [cap].
+ */
+static int zram_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+  uint16_t head[ZRAM_HASH]; // Last position + 1 of each hash, 0 for none
+  int i = 0, lit = 0, o = 0;
+
+  memset(head, 0, sizeof(head));
+  while (i + ZRAM_MINMATCH <= n) {
+    int h = ((src[i] << 4) ^ (src[i + 1] << 2) ^ src[i + 2]) & (ZRAM_HASH - 1);
+    int ref = head[h] - 1;
+    int len = 0;
+
+    head[h] = i + 1;
+    if (ref >= 0 && i - ref <= 0xffff) {
+      while (i + len < n && len < ZRAM_MAXMATCH && src[ref + len] == src[i + len])
+        len++;
+    }
+    if (len < ZRAM_MINMATCH) {
+      i++;
+      continue;
+    }
+    /* Literals pending before the match */
+    while (lit < i) {
+      int nlit = (i - lit < ZRAM_MAXLIT) ? i - lit : ZRAM_MAXLIT;
+      if (o + 1 + nlit > cap)
+        return -1;
+      dst[o++] = nlit - 1;
+      memcpy(dst + o, src + lit, nlit);
+      o += nlit;
+      lit += nlit;
+    }
+    if (o + 3 > cap)
+      return -1;
+    dst[o++] = 0x80 | (len - ZRAM_MINMATCH);
+    dst[o++] = (i - ref) & 0xff;
+    dst[o++] = (i - ref) >> 8;
+    i += len;
+    lit = i;
+  }
+  while (lit < n) {
+    int nlit = (n - lit < ZRAM_MAXLIT) ? n - lit : ZRAM_MAXLIT;
+    if (o + 1 + nlit > cap)
+      return -1;
+    dst[o++] = nlit - 1;
+    memcpy(dst + o, src + lit, nlit);
+    o += nlit;
+    lit += nlit;
+  }
+  return o;
+}
+
+static int zram_decompress(const uint8_t *src, int len, uint8_t *dst, int n)
+{
+  int i = 0, o = 0;
+
+  while (i < len) {
+    int c = src[i++];
+
+    if (c < 0x80) {
+      if (i + c + 1 > len || o + c + 1 > n)
+        return -1;
+      memcpy(dst + o, src + i, c + 1);
+      i += c + 1;
+      o += c + 1;
+    }
+    else {
+      int mlen = (c & 0x7f) + ZRAM_MINMATCH, off;
+      if (i + 2 > len)
+        return -1;
+      off = src[i] | (src[i + 1] << 8);
+      i += 2;
+      if (off == 0 || off > o || o + mlen > n)
+        return -1;
+      /* Byte by byte, a match may overlap what it produces */
+      for (; mlen > 0; mlen--, o++)
+        dst[o] = dst[o - off];
+    }
+  }
+  return (o == n) ? 0 : -1;
+}
+
+/*
+ * zram_create - make the compressed store of a swap device
+ * @nslots: number of frames of the device
+ * @pagesz: page size
+ *
+ */
+struct zram_struct *zram_create(int nslots, int pagesz)
+{
+  struct zram_struct *z = calloc(1, sizeof(struct zram_struct));
+
+  z->pagesz = pagesz;
+  z->nslots = nslots;
+  /* Zeroed slots are pages of zeroes */
+  z->slot = calloc(nslots > 0 ? nslots : 1, sizeof(struct zslot_t));
+  z->nclass = (pagesz + ZRAM_CLASS - 1) / ZRAM_CLASS;
+  z->freeblk = calloc(z->nclass, sizeof(void *));
+  return z;
+}
+
+/*
+ * zram_free - drop the page of a frame, which reads as zeroes again
+ * @z: compressed store
+ * @slot: frame
+ *
+ */
+void zram_free(struct zram_struct *z, int slot)
+{
+  struct zslot_t *s = &z->slot[slot];
+
+  if (s->data != NULL) {
+    zpool_free(z, s->data, s->len);
+    z->zbytes -= s->len;
+  }
+  s->data = NULL;
+  s->len = 0;
+  s->fill = 0;
+}
+
+/*
+ * zram_store - compress a page into a frame
+ * @z: compressed store
+ * @slot: frame
+ * @page: page to store, NULL for a page of zeroes
+ *
+ */
+int zram_store(struct zram_struct *z, int slot, const BYTE *page)
+{
+  uint8_t buf[z->pagesz];
+  struct zslot_t *s = &z->slot[slot];
+  int i, len;
+
+  zram_free(z, slot);
+  z->nstored++;
+  if (page == NULL) {
+    z->nsame++;
+    return 0;
+  }
+
+  for (i = 1; i < z->pagesz && page[i] == page[0]; i++)
+    ;
+  if (i == z->pagesz) {
+    s->fill = page[0];
+    z->nsame++;
+    return 0;
+  }
+
+  len = zram_compress((const uint8_t *)page, z->pagesz, buf, z->pagesz - 1);
+  if (len < 0)
+    len = z->pagesz; /* Incompressible, kept raw */
+  s->data = zpool_alloc(z, len);
+  if (s->data == NULL) {
+    printf(ANSI_COLOR_RED "ERROR: Out of memory for a compressed page!\n" ANSI_COLOR_RESET);
+    return -1;
+  }
+  memcpy(s->data, (len == z->pagesz) ? page : (const BYTE *)buf, len);
+  s->len = len;
+  z->zbytes += len;
+  z->zstored += len;
+  if (z->zbytes > z->zpeak)
+    z->zpeak = z->zbytes;
+  return 0;
+}
+
+/*
+ * zram_load - decompress the page of a frame
+ * @z: compressed store
+ * @slot: frame
+ * @page: buffer of a page
+ *
+ */
+int zram_load(struct zram_struct *z, int slot, BYTE *page)
+{
+  struct zslot_t *s = &z->slot[slot];
+
+  if (s->data == NULL) {
+    memset(page, s->fill, z->pagesz);
+    return 0;
+  }
+  if (s->len == (uint32_t)z->pagesz) {
+    memcpy(page, s->data, z->pagesz);
+    return 0;
+  }
+  if (zram_decompress((uint8_t *)s->data, s->len, (uint8_t *)page, z->pagesz) < 0) {
+    printf(ANSI_COLOR_RED "ERROR: Corrupted compressed page %d!\n" ANSI_COLOR_RESET, slot);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * zram_dup - copy the page of a frame to another compressed frame
+ * @src: source store
+ * @srcslot: source frame
+ * @dst: destination store, may be the source one
+ * @dstslot: destination frame
+ *
+ */
+int zram_dup(struct zram_struct *src, int srcslot, struct zram_struct *dst, int dstslot)
+{
+  struct zslot_t *s = &src->slot[srcslot], *d = &dst->slot[dstslot];
+
+  zram_free(dst, dstslot);
+  dst->nstored++;
+  if (s->data == NULL) {
+    d->fill = s->fill;
+    dst->nsame++;
+    return 0;
+  }
+  d->data = zpool_alloc(dst, s->len);
+  if (d->data == NULL)
+    return -1;
+  memcpy(d->data, s->data, s->len);
+  d->len = s->len;
+  dst->zbytes += s->len;
+  dst->zstored += s->len;
+  if (dst->zbytes > dst->zpeak)
+    dst->zpeak = dst->zbytes;
+  return 0;
+}
+
+/*
+ * zram_dump - print how densely a compressed swap holds its pages
+ * @z: compressed store
+ * @id: swap device number
+ *
+ */
+void zram_dump(struct zram_struct *z, int id)
+{
+  printf("Compressed swap %d: %lu pages stored in %lu bytes (%lu same-filled), "
+         "peak %lu bytes in a pool of %lu bytes\n",
+         id, z->nstored, z->zstored, z->nsame,
+         (unsigned long)z->zpeak, (unsigned long)z->pool_bytes);
+}
+
+//#endif
@@ -5,8 +5,12 @@
  */
 
 #include "mm.h"
+#include "perf.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+pthread_mutex_t MEM_in_use = PTHREAD_MUTEX_INITIALIZER;
 
 /* 
  * init_pte - Initialize PTE entry
@@ -55,6 +59,7 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
   // SETBIT(*pte, PAGING_PTE_PRESENT_MASK); Incorrect code??
   CLRBIT(*pte, PAGING_PTE_PRESENT_MASK);
   SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_COW_MASK);
 
   SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
   SETVAL(*pte, swpoff, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
@@ -71,6 +76,7 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_COW_MASK); /* a newly mapped frame is private */
 
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT); 
 
@@ -121,10 +127,12 @@ int vmap_page_range(struct pcb_t *caller, // process call
     if (ret_rg->vmaid == 0) {
       printf(ANSI_COLOR_PINK "[Page mapping]\tPID #%d:\tFrame:%d\tPTE:%08x\tPGN:%d\n" ANSI_COLOR_PINK, caller->pid, fpit->fpn, caller->mm->pgd[pgn + pgit], pgn + pgit);
       add_LRU_page(&(caller->mm->pgd[pgn + pgit]), pgn + pgit);
+      PERF_INC(caller, lru_update);
     }
     else {
       printf(ANSI_COLOR_PINK "[Page mapping]\tPID #%d:\tFrame:%d\tPTE:%08x\tPGN:%d\n" ANSI_COLOR_PINK, caller->pid, fpit->fpn, caller->mm->pgd[pgn - pgit], pgn - pgit);
       add_LRU_page(&(caller->mm->pgd[pgn - pgit]), pgn - pgit);
+      PERF_INC(caller, lru_update);
     }
     #else
     int enlist_fifo_ret = 0;
@@ -149,6 +157,165 @@ int vmap_page_range(struct pcb_t *caller, // process call
   return 0;
 }
 
+/*
+ * get_swpdev - swap device of a swap type
+ * @caller : caller
+ * @swptyp : swap type, index of the device in caller->mswp
+ */
+struct memphy_struct *get_swpdev(struct pcb_t *caller, int swptyp)
+{
+  /* The loader hands over the array of devices itself */
+  return (struct memphy_struct *)caller->mswp + swptyp;
+}
+
+/*
+ * pg_getswpfp - get a free frame in swap, active device first
+ * @caller : caller
+ * @swptyp : return swap type of the device
+ * @swpfpn : return frame number in that device
+ */
+int pg_getswpfp(struct pcb_t *caller, int *swptyp, int *swpfpn)
+{
+  int i;
+
+  *swptyp = caller->active_mswp - get_swpdev(caller, 0);
+  if (MEMPHY_get_freefp(caller->active_mswp, swpfpn) == 0)
+    return 0;
+
+  printf("Current active swap doesn't have any free frame\n");
+  for (i = 0; i < PAGING_MAX_MMSWP; i++) {
+    struct memphy_struct *mswp = get_swpdev(caller, i);
+    if (mswp->maxsz > 0 && MEMPHY_get_freefp(mswp, swpfpn) == 0) {
+      caller->active_mswp = mswp;
+      *swptyp = i;
+      return 0;
+    }
+  }
+  return -3000; // MEMSWAP doesn't have any free frame
+}
+
+/*
+ * pg_evict - free a frame in ram by moving a victim page to swap
+ * @caller : caller
+ * @retfpn : return the freed frame
+ *
+ * The victim comes from the replacement policy in use. Every PTE
+ * mapping the victim frame is pointed at the swap frame. A private
+ * victim with nothing but zeroes takes no swap frame and is marked
+ * PAGING_SWPTYP_ZERO instead, so it is evicted even with swap full.
+ * Must be called with MEM_in_use held.
+ */
+int pg_evict(struct pcb_t *caller, int *retfpn)
+{
+  int vicpgn, vicfpn, swptyp, swpfpn;
+  uint32_t *vicpte;
+
+#ifdef LRU
+  if (find_LRU_victim_page(caller->mram, &vicpgn, &vicfpn, &vicpte) < 0) {
+#else
+  if (find_victim_page(caller->mm, caller->mram, &vicpgn) < 0) {
+#endif
+    printf("Failed to find victim page!!!\n");
+    return -1;
+  }
+#ifndef LRU
+  vicpte = &caller->mm->pgd[vicpgn];
+  vicfpn = PAGING_PTE_FPN(*vicpte);
+#endif
+
+  if (MEMPHY_zero_page(caller->mram, vicfpn, PAGING_PAGESZ)
+      && !MEMPHY_get_shared(caller->mram, vicfpn)) {
+    swptyp = PAGING_SWPTYP_ZERO;
+    swpfpn = 0;
+  }
+  else if (pg_getswpfp(caller, &swptyp, &swpfpn) < 0) {
+    /* The victim stays in ram, as the newest page */
+#ifdef LRU
+    add_LRU_page(vicpte, vicpgn);
+#else
+    enlist_pgn_node(&caller->mm->fifo_pgn, vicpgn);
+#endif
+    return -3000; // MEMSWAP doesn't have any free frame
+  }
+
+#ifdef RAM_STATUS_DUMP
+  if (swptyp == PAGING_SWPTYP_ZERO)
+    printf(ANSI_COLOR_PINK "\tZero vicfpn=%d, no swap frame\n", vicfpn);
+  else
+    printf(ANSI_COLOR_PINK "\tCopy vicfpn=%d to swpfpn=%d\n", vicfpn, swpfpn);
+  printf("[Page Replacement]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte);
+#endif
+  if (swptyp != PAGING_SWPTYP_ZERO)
+    swapio_write(caller->mram, vicfpn, get_swpdev(caller, swptyp), swpfpn);
+  PERF_INC(caller, swapout);
+
+  /* Update page table */
+  if (shm_swapout(caller->mram, vicfpn, swptyp, swpfpn) == 0)
+    pte_set_swap(vicpte, swptyp, swpfpn);
+  printf(ANSI_COLOR_PINK "[After Swap]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte);
+
+  *retfpn = vicfpn;
+  return 0;
+}
+
+/*
+ * pg_swapin - bring a swapped page back to ram
+ * @caller : caller
+ * @pte    : page table entry of the page
+ * @pgn    : page number
+ * @retfpn : return the frame holding the page
+ *
+ * Must be called with MEM_in_use held. The swap frame is read before
+ * a RAM frame is taken, MEM_in_use is let go meanwhile, so return 1
+ * when the PTE changed under the read and has to be looked at again.
+ */
+int pg_swapin(struct pcb_t *caller, uint32_t *pte, int pgn, int *retfpn)
+{
+  uint32_t oldpte = *pte;
+  int swptyp = PAGING_SWPTYP(oldpte);
+  int swpoff = PAGING_SWPOFF(oldpte);
+  struct memphy_struct *mswp = NULL;
+  BYTE page[PAGING_PAGESZ];
+  int fpn, ret;
+
+  if (swptyp != PAGING_SWPTYP_ZERO) {
+    mswp = get_swpdev(caller, swptyp);
+    if ((ret = swapio_read(mswp, swpoff, page)) < 0)
+      return ret;
+    if (ret > 0 || *pte != oldpte)
+      return 1;
+  }
+
+  if (MEMPHY_get_freefp(caller->mram, &fpn) < 0) {
+    /* RAM doesn't have any free frame -> Paging */
+    if ((ret = pg_evict(caller, &fpn)) < 0)
+      return ret;
+  }
+
+  if (swptyp == PAGING_SWPTYP_ZERO) {
+    /* Never shared, nothing to copy */
+    MEMPHY_fill(caller->mram, fpn * PAGING_PAGESZ, 0, PAGING_PAGESZ);
+    pte_set_fpn(pte, fpn);
+  }
+  else {
+    MEMPHY_write_page(caller->mram, fpn, page, PAGING_PAGESZ);
+
+    /* A shared page is reachable again from every mapper */
+    if (shm_swapin(caller->mram, swptyp, swpoff, fpn) == 0)
+      pte_set_fpn(pte, fpn);
+    swapio_release(mswp, swpoff);
+  }
+  PERF_INC(caller, swapin);
+#ifndef LRU
+  enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+#else
+  (void)pgn;
+#endif
+
+  *retfpn = fpn;
+  return 0;
+}
+
 /* 
  * alloc_pages_range - allocate req_pgnum of frame in ram
  * @caller    : caller
@@ -159,68 +326,24 @@ int vmap_page_range(struct pcb_t *caller, // process call
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct** frm_lst)
 {
 
-  int pgit, fpn;
+  int pgit, fpn, ret, start = -1;
   struct framephy_struct *newfp_str;
 
+  /* Contiguous frames when RAM has a run long enough: one lock and
+   * one scan take them all instead of one per page. Eviction and
+   * swap-in still work page by page */
+  if (req_pgnum > 1 && MEMPHY_get_freefp_range(caller->mram, req_pgnum, &start) < 0)
+    start = -1;
+
   for(pgit = 0; pgit < req_pgnum; pgit++)
   {
-    if(MEMPHY_get_freefp(caller->mram, &fpn) < 0) // ERROR CODE of obtaining somes but not enough frames
+    if (start >= 0)
+      fpn = start + pgit;
+    else if(MEMPHY_get_freefp(caller->mram, &fpn) < 0) // ERROR CODE of obtaining somes but not enough frames
     {
       // RAM doesn't have any free frame -> Paging
-      int vicpgn, swpfpn;
-      int vicfpn;
-      #ifdef LRU
-      uint32_t* vicpte;
-      find_LRU_victim_page(&vicpgn, &vicfpn, &vicpte);
-      #else
-      /* Find victim page */
-      if (find_victim_page(caller->mm, &vicpgn) < 0) {
-        printf("Failed to find victim page!!!\n");
-        return -1;
-      }
-      uint32_t vicpte;
-      vicpte = caller->mm->pgd[vicpgn];
-      vicfpn = PAGING_PTE_FPN(vicpte);
-      #endif
-
-      /* Find index of avtive memswap */
-      int index_of_active_mswp;
-      for (index_of_active_mswp = 0; index_of_active_mswp < PAGING_MAX_MMSWP; index_of_active_mswp++) {
-        if ((struct memphy_struct *)&caller->mswp[index_of_active_mswp] == caller->active_mswp) break;
-      }
-      /* Get free frame in MEMSWP */
-      if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) < 0) {
-        printf("Current active swap doesn't have any free frame\n");
-        int i;
-        for (i = 0; i < PAGING_MAX_MMSWP; i++) {
-          if (MEMPHY_get_freefp(caller->mswp[i], &swpfpn) == 0) {
-            caller->active_mswp = (struct memphy_struct *)&caller->mswp[i];
-            index_of_active_mswp = i;
-            break;
-          }
-        }
-        if (i == PAGING_MAX_MMSWP) return -3000; // MEMSWAP doesn't have any free frame
-      }
-      #ifdef RAM_STATUS_DUMP
-      printf(ANSI_COLOR_PINK "\tCopy vicfpn=%d to swpfpn=%d\n", vicfpn, swpfpn); 
-      #ifdef LRU
-      printf("[Page Replacement]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte);
-      #else
-      printf("[Page Replacement]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, vicpte);
-      #endif
-      #endif
-      __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
-
-      /* Update page table */
-      #ifdef LRU 
-      pte_set_swap(vicpte, index_of_active_mswp, swpfpn);
-      printf(ANSI_COLOR_PINK "[After Swap]\tPID #%d:\tVic FPN:%d\tVic PGN:%d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, *vicpte);
-      #else
-      pte_set_swap(&caller->mm->pgd[vicpgn], index_of_active_mswp, swpfpn*PAGING_PAGESZ);
-      printf(ANSI_COLOR_PINK "[After Swap]\tPID #%d:\tVic FPN:%d\tVic PGN: %d\tPTE:%08x\n" ANSI_COLOR_RESET, caller->pid, vicfpn, vicpgn, caller->mm->pgd[vicpgn]);
-      #endif
-      fpn = vicfpn;
-      
+      if ((ret = pg_evict(caller, &fpn)) < 0)
+        return ret; // -3000 if MEMSWAP doesn't have any free frame
     } 
     // Add newfp_str to frm_lst
     newfp_str = (struct framephy_struct*)malloc(sizeof(struct framephy_struct));
@@ -315,19 +438,7 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) 
 {
-  int cellidx;
-  int addrsrc,addrdst;
-  for(cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
-  {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
-
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    MEMPHY_write(mpdst, addrdst, data);
-  }
-
-  return 0;
+  return MEMPHY_cp_page(mpsrc, srcfpn, mpdst, dstfpn, PAGING_PAGESZ);
 }
 
 /*
@@ -340,7 +451,11 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   struct vm_area_struct * vma0 = malloc(sizeof(struct vm_area_struct));
   struct vm_area_struct * vma1 = malloc(sizeof(struct vm_area_struct));
 
-  mm->pgd = malloc(PAGING_MAX_PGN*sizeof(uint32_t));
+  mm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  memset(mm->symrgtbl, 0, sizeof(mm->symrgtbl));
+  mm->fifo_pgn = NULL;
+  mm->mm_users = 1;
+  pthread_mutex_init(&mm->lock, NULL);
 
   /* By default the owner comes with at least one vma for DATA */
   vma0->vm_id = 0;
@@ -348,6 +463,7 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   vma0->vm_end = vma0->vm_start;
   vma0->sbrk = vma0->vm_start;
   struct vm_rg_struct *first_rg = init_vm_rg(vma0->vm_start, vma0->vm_end, 0);
+  vma0->vm_freerg_list = NULL;
   enlist_vm_rg_node(&vma0->vm_freerg_list, first_rg);
 
   /* TODO update VMA0 next */
@@ -363,6 +479,7 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   // enlist_vm_rg_node(&vma1...)
   struct vm_rg_struct *second_rg = init_vm_rg(vma1->vm_start, vma1->vm_end, 1);
   vma1->vm_next = NULL;
+  vma1->vm_freerg_list = NULL;
   enlist_vm_rg_node(&vma1->vm_freerg_list, second_rg);
 
   /* Point vma owner backward */
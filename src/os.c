@@ -4,6 +4,10 @@
 #include "sched.h"
 #include "loader.h"
 #include "mm.h"
+#include "perf.h"
+#include "iodev.h"
+#include "prof.h"
+#include "parse.h"
 
 #include <pthread.h>
 #include <stdio.h>
@@ -14,11 +18,13 @@
 static int time_slot;
 static int num_cpus;
 static int done = 0;
-static int cnt_proc_done = 0; // for setting stop condition for CPU when all processes have been completed
+static uint32_t cnt_proc_done = 0; // for setting stop condition for CPU when all processes have been completed
+static int cpu_stopped = 0; // number of stopped CPUs, the I/O device stops after the last one
 
 #ifdef MM_PAGING
 static int memramsz;
 static int memswpsz[PAGING_MAX_MMSWP];
+static char * memswpfile[PAGING_MAX_MMSWP]; // Host file of a swap, "zram" compressed, NULL in memory
 #ifdef MM_PAGING_HEAP_GODOWN
 static int vmemsz;
 #endif
@@ -52,6 +58,9 @@ static void * cpu_routine(void * args) {
 	sleep(1);
 	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
 	int id = ((struct cpu_args*)args)->id;
+#ifdef MM_PAGING
+	MEMPHY_set_cpu(id);
+#endif
 	/* Check for new process in ready queue */
 	int time_left = 0;
 	struct pcb_t * proc = NULL;
@@ -65,7 +74,7 @@ static void * cpu_routine(void * args) {
 			proc = get_proc();
 			if (proc == NULL) {
 				// Add condition to make sure that CPU don't execute indefinitely
-				if (cnt_proc_done == num_processes)
+				if (done && cnt_proc_done == proc_count())
 				{
 					printf(ANSI_COLOR_CYAN "\tCPU %d stopped" ANSI_COLOR_RESET "\n", id);
 					break;
@@ -78,20 +87,30 @@ static void * cpu_routine(void * args) {
 			/* The porcess has finish it job */
 			printf(ANSI_COLOR_CYAN "\tCPU %d: Processed %2d has finished" ANSI_COLOR_RESET "\n",
 				id ,proc->pid);
-			free(proc);
+			perf_dump(proc);
+			prof_collect(proc);
+#ifdef MM_PAGING
+			free_pcb_memph(proc);
+#endif
+			free_pcb(proc);
 			proc = get_proc();
 			time_left = 0;
-			cnt_proc_done++;
+			__sync_fetch_and_add(&cnt_proc_done, 1);
 		}else if (time_left == 0) {
 			/* The process has done its job in current time slot */
 			printf(ANSI_COLOR_CYAN "\tCPU %d: Put process %2d to run queue" ANSI_COLOR_RESET "\n",
 				id, proc->pid);
+#ifdef PERFCTR
+			proc->perf.ready_since = current_time();
+#endif
 			put_proc(proc);
 			proc = get_proc();
 		}
 		
-		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
+		/* Recheck process status after loading new process. Blocked
+		 * processes come back to the ready queue later, so keep
+		 * polling it while any of them are still waiting */
+		if (proc == NULL && done && io_pending() == 0 && queue_empty() == 1) {
 			/* No process to run, exit */
 			printf(ANSI_COLOR_CYAN "\tCPU %d stopped" ANSI_COLOR_RESET "\n", id);
 			break;
@@ -103,54 +122,143 @@ static void * cpu_routine(void * args) {
 		}else if (time_left == 0) {
 			printf(ANSI_COLOR_CYAN "\tCPU %d: Dispatched process %2d" ANSI_COLOR_RESET "\n",
 				id, proc->pid);
+			PERF_ADD(proc, slot_wait, current_time() - proc->perf.ready_since);
 			time_left = time_slot;
 		}
 		
-		/* Run current process */
-		run(proc);
-		time_left--;
-		next_slot(timer_id);
+		/* Run current process, a run of CALCs is retired in one
+		 * step and the timer accounts for the slots it covers */
+		uint32_t slots = run_calc(proc, time_left);
+		if (slots > 0) {
+			PERF_ADD(proc, slot_run, slots);
+			time_left -= slots;
+			next_slots(timer_id, slots);
+		}else{
+			run(proc);
+			PERF_INC(proc, slot_run);
+			time_left--;
+			if (proc->state == PROC_BLOCKED) {
+				/* The process now belongs to the device or
+				 * queue that will wake it up, release the CPU */
+				printf(ANSI_COLOR_CYAN "\tCPU %d: Process %2d blocked" ANSI_COLOR_RESET "\n",
+					id, proc->pid);
+				proc = NULL;
+				time_left = 0;
+			}else if (proc->state == PROC_YIELDED) {
+				/* Back to the run queue at the next check */
+				proc->state = PROC_RUNNABLE;
+				time_left = 0;
+			}
+			next_slot(timer_id);
+		}
 	}
+	__sync_fetch_and_add(&cpu_stopped, 1);
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
-static void * ld_routine(void * args) {
+/* PCBs prepared ahead of their arrival, in config order. The prefetcher
+ * fills the queue off the timer, so parsing and init_mm() never hold up
+ * a time slot, and admission only takes the next one out */
+#define LD_PREFETCH	8
+
+static struct {
+	struct pcb_t * proc[LD_PREFETCH];	// NULL for a program that failed to load
+	int head;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} ld_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void * prefetch_routine(void * args) {
 #ifdef MM_PAGING
 	struct memphy_struct* mram = ((struct mmpaging_ld_args *)args)->mram;
 	struct memphy_struct** mswp = ((struct mmpaging_ld_args *)args)->mswp;
 	struct memphy_struct* active_mswp = ((struct mmpaging_ld_args *)args)->active_mswp;
+#endif
+	int i;
+	for (i = 0; i < num_processes; i++) {
+		struct pcb_t * proc = load_pcb(ld_processes.path[i]);
+		if (proc != NULL) {
+#ifdef MLQ_SCHED
+			proc->prio = ld_processes.prio[i];
+#endif
+#ifdef MM_PAGING
+			proc->mm = malloc(sizeof(struct mm_struct));
+#ifdef MM_PAGING_HEAP_GODOWN
+			proc->vmemsz = vmemsz;
+#endif
+			init_mm(proc->mm, proc);
+			proc->mram = mram;
+			proc->mswp = mswp;
+			proc->active_mswp = active_mswp;
+#endif
+		}
+		pthread_mutex_lock(&ld_queue.lock);
+		while (ld_queue.count == LD_PREFETCH) {
+			pthread_cond_wait(&ld_queue.not_full, &ld_queue.lock);
+		}
+		ld_queue.proc[(ld_queue.head + ld_queue.count) % LD_PREFETCH] = proc;
+		ld_queue.count++;
+		pthread_cond_signal(&ld_queue.not_empty);
+		pthread_mutex_unlock(&ld_queue.lock);
+	}
+	pthread_exit(NULL);
+}
+
+static struct pcb_t * next_prefetched(void) {
+	struct pcb_t * proc;
+	pthread_mutex_lock(&ld_queue.lock);
+	while (ld_queue.count == 0) {
+		pthread_cond_wait(&ld_queue.not_empty, &ld_queue.lock);
+	}
+	proc = ld_queue.proc[ld_queue.head];
+	ld_queue.head = (ld_queue.head + 1) % LD_PREFETCH;
+	ld_queue.count--;
+	pthread_cond_signal(&ld_queue.not_full);
+	pthread_mutex_unlock(&ld_queue.lock);
+	return proc;
+}
+
+static void * ld_routine(void * args) {
+#ifdef MM_PAGING
 	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
 #else
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 #endif
+	pthread_t prefetch;
 	int i = 0;
 	printf("ld_routine\n");
+	pthread_create(&prefetch, NULL, prefetch_routine, args);
 	while (i < num_processes) {
-		struct pcb_t * proc = load(ld_processes.path[i]);
-#ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
-#endif
 		while (current_time() < ld_processes.start_time[i]) {
 			next_slot(timer_id);
 		}
-#ifdef MM_PAGING
-		proc->mm = malloc(sizeof(struct mm_struct));
-#ifdef MM_PAGING_HEAP_GODOWN
-		proc->vmemsz = vmemsz;
-#endif
-		init_mm(proc->mm, proc);
-		proc->mram = mram;
-		proc->mswp = mswp;
-		proc->active_mswp = active_mswp;
-#endif
+		struct pcb_t * proc = next_prefetched();
+		if (proc == NULL) {
+			/* The error is reported, run the others anyway */
+			i++;
+			continue;
+		}
+		assign_pid(proc);
 		printf(ANSI_COLOR_CYAN "\tLoaded a process at %s, PID: %d PRIO: %ld" ANSI_COLOR_RESET "\n",
 			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
+#ifdef PERFCTR
+		proc->perf.ready_since = current_time();
+#endif
 		add_proc(proc);
-		free(ld_processes.path[i]);
 		i++;
 		next_slot(timer_id);
 	}
+	pthread_join(prefetch, NULL);
+	for (i = 0; i < num_processes; i++) {
+		free(ld_processes.path[i]);
+	}
 	free(ld_processes.path);
 	free(ld_processes.start_time);
 	done = 1;
@@ -158,19 +266,40 @@ static void * ld_routine(void * args) {
 	pthread_exit(NULL);
 }
 
+static void * io_routine(void * args) {
+	struct timer_id_t * timer_id = (struct timer_id_t*)args;
+	/* Wake up the processes whose I/O request is done once per slot */
+	while (__sync_fetch_and_add(&cpu_stopped, 0) < num_cpus) {
+		io_complete(current_time());
+		next_slot(timer_id);
+	}
+	detach_event(timer_id);
+	pthread_exit(NULL);
+}
+
+static void bad_config(struct parse_t * ps) {
+	parse_close(ps);
+	exit(1);
+}
+
 static void read_config(const char * path) {
-	FILE * file;
-	if ((file = fopen(path, "r")) == NULL) {
+	struct parse_t ps;
+	uint32_t val;
+	if (parse_open(&ps, path) < 0) {
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
-	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
+	if (parse_u32(&ps, &val, "time slot") < 0) bad_config(&ps);
+	time_slot = val;
+	if (parse_u32(&ps, &val, "number of CPUs") < 0) bad_config(&ps);
+	num_cpus = val;
+	if (parse_u32(&ps, &val, "number of processes") < 0) bad_config(&ps);
+	num_processes = val;
 	ld_processes.path = (char**)malloc(sizeof(char*) * num_processes);
 	ld_processes.start_time = (unsigned long*)
 		malloc(sizeof(unsigned long) * num_processes);
 #ifdef MM_PAGING
 	int sit;
-#ifdef MM_FIXED_MEMSZ
 	/* We provide here a back compatible with legacy OS simulatiom config file
          * In which, it have no addition config line for Mema, keep only one line
 	 * for legacy info 
@@ -181,21 +310,42 @@ static void read_config(const char * path) {
 	for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
 		memswpsz[sit] = 0;
 #ifdef MM_PAGING_HEAP_GODOWN
-	vmemsz = 0x300000
+	vmemsz = 0x300000;
 #endif
-#else
+#ifndef MM_FIXED_MEMSZ
 	/* Read input config of memory size: MEMRAM and upto 4 MEMSWP (mem swap)
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
-	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
-	*/
-	fscanf(file, "%d\n", &memramsz);
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		fscanf(file, "%d", &(memswpsz[sit])); 
+	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ [VMEM_SZ]
+	 * A legacy config goes straight to the processes, a missing size
+	 * keeps its default above. A swap size written SIZE@FILE is stored
+	 * in the host file FILE instead of memory, SIZE@zram is stored
+	 * compressed in memory
+	 */
+	int ntok = parse_numeric_line(&ps);
+	if (ntok > 0) {
+		if (parse_u32(&ps, &val, "RAM size") < 0) bad_config(&ps);
+		memramsz = val;
+		for(sit = 0; sit < PAGING_MAX_MMSWP && sit + 1 < ntok; sit++) {
+			const char * file;
+			uint32_t len;
+			if (parse_u32_tag(&ps, &val, '@', &file, &len, "swap size") < 0) bad_config(&ps);
+			memswpsz[sit] = val;
+			if (file != NULL) {
+				memswpfile[sit] = (char*)malloc(len + 1);
+				memcpy(memswpfile[sit], file, len);
+				memswpfile[sit][len] = '\0';
+			}
+		}
+		/* A line with the RAM size alone keeps the default swaps */
+		for(; sit > 0 && sit < PAGING_MAX_MMSWP; sit++)
+			memswpsz[sit] = 0;
 #ifdef MM_PAGING_HEAP_GODOWN
-	fscanf(file, "%d\n", &vmemsz);
+		if (ntok > PAGING_MAX_MMSWP + 1) {
+			if (parse_u32(&ps, &val, "virtual memory size") < 0) bad_config(&ps);
+			vmemsz = val;
+		}
 #endif
-
-       fscanf(file, "\n"); /* Final character */
+	}
 #endif
 #endif
 
@@ -205,23 +355,26 @@ static void read_config(const char * path) {
 #endif
 	int i;
 	for (i = 0; i < num_processes; i++) {
-		ld_processes.path[i] = (char*)malloc(sizeof(char) * 100);
-		ld_processes.path[i][0] = '\0';
-		strcat(ld_processes.path[i], "input/proc/");
-		char proc[100];
+		uint64_t num;
+		const char * name;
+		uint32_t len;
+		if (parse_u64(&ps, &num, "start time") < 0) bad_config(&ps);
+		ld_processes.start_time[i] = num;
+		if (parse_word(&ps, &name, &len, "program") < 0) bad_config(&ps);
+		ld_processes.path[i] = (char*)malloc(sizeof("input/proc/") + len);
+		memcpy(ld_processes.path[i], "input/proc/", sizeof("input/proc/") - 1);
+		memcpy(ld_processes.path[i] + sizeof("input/proc/") - 1, name, len);
+		ld_processes.path[i][sizeof("input/proc/") - 1 + len] = '\0';
 #ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
-#else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
+		if (parse_u64(&ps, &num, "priority") < 0) bad_config(&ps);
+		ld_processes.prio[i] = num;
 #endif
-		strcat(ld_processes.path[i], proc);
 	}
+	parse_close(&ps);
 }
 
 int main(int argc, char * argv[]) {
 #ifdef LRU
-	static struct LRU_struct *lru_head = NULL;
-	static struct LRU_struct *lru_tail = NULL;
 	pthread_mutex_init(&LRU_lock, NULL);
 #endif
 	/* Init lock */
@@ -231,9 +384,9 @@ int main(int argc, char * argv[]) {
 		printf("Usage: os [path to configure file]\n");
 		return 1;
 	}
-	char path[100];
-	path[0] = '\0';
-	strcat(path, "input/");
+	/* Long enough for the profile path too */
+	char * path = (char*)malloc(sizeof("output/") + strlen(argv[1]) + sizeof(".folded"));
+	strcpy(path, "input/");
 	strcat(path, argv[1]);
 	read_config(path);
 
@@ -241,6 +394,7 @@ int main(int argc, char * argv[]) {
 	struct cpu_args * args =
 		(struct cpu_args*)malloc(sizeof(struct cpu_args) * num_cpus);
 	pthread_t ld;
+	pthread_t io;
 	
 	/* Init timer */
 	int i;
@@ -249,6 +403,7 @@ int main(int argc, char * argv[]) {
 		args[i].id = i;
 	}
 	struct timer_id_t * ld_event = attach_event();
+	struct timer_id_t * io_event = attach_event();
 	start_timer();
 
 #ifdef MM_PAGING
@@ -260,10 +415,24 @@ int main(int argc, char * argv[]) {
 
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+	MEMPHY_mag_init(&mram, num_cpus);
+#ifdef SWAP_IO
+	swapio_start(SWAP_IO);
+#endif
         /* Create all MEM SWAP */ 
 	int sit;
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+		if (memswpfile[sit] == NULL) {
+			init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+		}
+		else if (strcmp(memswpfile[sit], "zram") == 0) {
+			init_memphy_zram(&mswp[sit], memswpsz[sit], rdmflag);
+		}
+		else if (init_memphy_file(&mswp[sit], memswpsz[sit], rdmflag, memswpfile[sit]) < 0) {
+			exit(1);
+		}
+		free(memswpfile[sit]);
+	}
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
@@ -290,12 +459,33 @@ int main(int argc, char * argv[]) {
 		pthread_create(&cpu[i], NULL,
 			cpu_routine, (void*)&args[i]);
 	}
+	pthread_create(&io, NULL, io_routine, (void*)io_event);
 
 	/* Wait for CPU and loader finishing */
 	for (i = 0; i < num_cpus; i++) {
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+	pthread_join(io, NULL);
+
+	/* The profile is kept next to the reference outputs */
+	path[0] = '\0';
+	strcat(path, "output/");
+	strcat(path, argv[1]);
+	strcat(path, ".folded");
+	prof_report(path);
+	free(path);
+#ifdef MM_PAGING
+	/* The queued writes land before the devices are dumped */
+	swapio_stop();
+	swapio_dump();
+	msg_dump();
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+		if (mswp[sit].zram != NULL) {
+			zram_dump(mswp[sit].zram, sit);
+		}
+	}
+#endif
 
 	/* Stop timer */
 	stop_timer();
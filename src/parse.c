@@ -0,0 +1,238 @@
+
+#include "parse.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline int is_blank(char c) {
+	/* '\t' '\n' '\v' '\f' '\r' are contiguous */
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+/* Move to the next token, counting the lines on the way */
+static void skip_blank(struct parse_t * ps) {
+	while (ps->p < ps->end && is_blank(*ps->p)) {
+		if (*ps->p == '\n') {
+			ps->line++;
+		}
+		ps->p++;
+	}
+}
+
+void parse_init(struct parse_t * ps, const char * path, const void * data, size_t size) {
+	ps->path = path;
+	ps->p = (const char *)data;
+	ps->end = ps->p + size;
+	ps->line = 1;
+	ps->image = NULL;
+	ps->size = 0;
+	ps->version = 0;
+}
+
+int parse_open(struct parse_t * ps, const char * path) {
+	struct stat st;
+	void * image = NULL;
+	size_t size = 0;
+	int fd, known;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	known = fstat(fd, &st) == 0;
+	if (known && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size = st.st_size;
+		image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	parse_init(ps, path, image, size);
+	ps->image = image;
+	ps->size = size;
+	/* A file rewritten in place gets a new mtime, one replaced by
+	 * a rename a new inode */
+	if (known) {
+		ps->version = ((uint64_t)st.st_ino * 0x9e3779b97f4a7c15ULL)
+				^ ((uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec)
+				^ ((uint64_t)st.st_size << 32);
+	}
+	return 0;
+}
+
+void parse_close(struct parse_t * ps) {
+	if (ps->image != NULL) {
+		munmap(ps->image, ps->size);
+		ps->image = NULL;
+	}
+}
+
+void parse_error(const struct parse_t * ps, const char * fmt, ...) {
+	va_list ap;
+	printf("%s:%u: ", ps->path, ps->line);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Value of the leading digits of the 8 bytes at [p], their count goes
+ * to [n]. The bytes are taken as one word, the first in the low byte */
+static inline uint64_t swar_digits(const char * p, int * n) {
+	uint64_t w, t, nz;
+
+	memcpy(&w, p, 8);
+	/* A byte is zero in [t] if and only if it is a digit: its high
+	 * nibble is 3, and still is once 6 is added */
+	t = ((w & 0xf0f0f0f0f0f0f0f0ULL) | (((w + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4))
+			^ 0x3333333333333333ULL;
+	nz = (((t & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | t) & 0x8080808080808080ULL;
+	*n = nz ? __builtin_ctzll(nz) >> 3 : 8;
+	if (*n == 0) {
+		return 0;
+	}
+	/* Drop what follows the digits, the bytes shifted in are zeroes
+	 * leading the number, then add up pairs, quads and the halves */
+	w = (w & 0x0f0f0f0f0f0f0f0fULL) << (64 - *n * 8);
+	w = (w * 2561) >> 8;
+	w = ((w & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+	return ((w & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+/* Read a number ending at a blank, or at [sep] unless it is 0 */
+static int scan_u64(struct parse_t * ps, uint64_t * val, char sep, const char * what) {
+	uint64_t v = 0;
+	const char * p;
+
+	skip_blank(ps);
+	p = ps->p;
+	if (p == ps->end) {
+		parse_error(ps, "expected %s, got end of file", what);
+		return -1;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (ps->end - p >= 8) {
+		/* Up to 8 digits at once, the rest one by one below */
+		int n;
+		v = swar_digits(p, &n);
+		p += n;
+	}
+#endif
+	while (p < ps->end && *p >= '0' && *p <= '9') {
+		uint64_t d = *p - '0';
+		/* Nineteen digits always fit */
+		if (p - ps->p >= 19 && v > (UINT64_MAX - d) / 10) {
+			parse_error(ps, "%s is out of range", what);
+			return -1;
+		}
+		v = v * 10 + d;
+		p++;
+	}
+	if (p == ps->p || (p < ps->end && !is_blank(*p) && (sep == 0 || *p != sep))) {
+		const char * q = ps->p;
+		while (q < ps->end && !is_blank(*q)) {
+			q++;
+		}
+		parse_error(ps, "expected %s, got '%.*s'", what, (int)(q - ps->p), ps->p);
+		return -1;
+	}
+	ps->p = p;
+	*val = v;
+	return 0;
+}
+
+int parse_u64(struct parse_t * ps, uint64_t * val, const char * what) {
+	return scan_u64(ps, val, 0, what);
+}
+
+int parse_u32(struct parse_t * ps, uint32_t * val, const char * what) {
+	uint64_t v;
+
+	if (parse_u64(ps, &v, what) < 0) {
+		return -1;
+	}
+	if (v > UINT32_MAX) {
+		parse_error(ps, "%s is out of range", what);
+		return -1;
+	}
+	*val = v;
+	return 0;
+}
+
+int parse_u32_tag(struct parse_t * ps, uint32_t * val, char sep,
+		const char ** tag, uint32_t * len, const char * what) {
+	uint64_t v;
+	const char * p;
+
+	if (scan_u64(ps, &v, sep, what) < 0) {
+		return -1;
+	}
+	if (v > UINT32_MAX) {
+		parse_error(ps, "%s is out of range", what);
+		return -1;
+	}
+	*val = v;
+	*tag = NULL;
+	*len = 0;
+	if (ps->p == ps->end || *ps->p != sep) {
+		return 0;
+	}
+	for (p = ++ps->p; p < ps->end && !is_blank(*p); p++)
+		;
+	if (p == ps->p) {
+		parse_error(ps, "expected a name after '%c' in %s", sep, what);
+		return -1;
+	}
+	*tag = ps->p;
+	*len = p - ps->p;
+	ps->p = p;
+	return 0;
+}
+
+int parse_word(struct parse_t * ps, const char ** word, uint32_t * len, const char * what) {
+	const char * p;
+
+	skip_blank(ps);
+	if (ps->p == ps->end) {
+		parse_error(ps, "expected %s, got end of file", what);
+		return -1;
+	}
+	for (p = ps->p; p < ps->end && !is_blank(*p); p++)
+		;
+	*word = ps->p;
+	*len = p - ps->p;
+	ps->p = p;
+	return 0;
+}
+
+int parse_numeric_line(const struct parse_t * ps) {
+	const char * p = ps->p;
+	int n = 0;
+
+	/* The current line is the one of the next token */
+	while (p < ps->end && is_blank(*p)) {
+		p++;
+	}
+	while (p < ps->end && *p != '\n') {
+		if (is_blank(*p)) {
+			p++;
+			continue;
+		}
+		if (*p < '0' || *p > '9') {
+			return -1;
+		}
+		while (p < ps->end && !is_blank(*p)) {
+			p++;
+		}
+		n++;
+	}
+	return n;
+}
+
@@ -0,0 +1,93 @@
+
+#include "perf.h"
+#include "timer.h"
+#include <stdio.h>
+
+#define PERF_DUMP_MAX 2048
+
+static const char * opcode_name[NUM_OPCODES] = {
+	[CALC] = "calc",
+	[ALLOC] = "alloc",
+#ifdef MM_PAGING
+	[MALLOC] = "malloc",
+#endif
+	[FREE] = "free",
+	[READ] = "read",
+	[WRITE] = "write",
+#ifdef MM_PAGING
+	[FILL] = "fill",
+	[COPY] = "copy",
+	[LOAD32] = "load32",
+	[STORE32] = "store32",
+	[LOAD64] = "load64",
+	[STORE64] = "store64",
+#endif
+	[IO] = "io",
+	[SLEEP] = "sleep",
+	[YIELD] = "yield",
+#ifdef MM_PAGING
+	[FORK] = "fork",
+	[SHMGET] = "shmget",
+	[SHMAT] = "shmat",
+	[THREAD] = "thread",
+	[SEND] = "send",
+	[RECV] = "recv",
+#endif
+};
+
+const char * perf_opname(enum ins_opcode_t opcode) {
+	return opcode_name[opcode];
+}
+
+int perf_szclass(uint32_t size) {
+	int cls = 0;
+	uint32_t limit = 256;
+	while (cls < PERF_NUM_SZCLASS - 1 && size > limit) {
+		limit <<= 2;
+		cls++;
+	}
+	return cls;
+}
+
+void perf_dump(struct pcb_t * proc) {
+#ifdef PERFCTR
+	/* Build the whole block first so it is not interleaved with the
+	 * output of other CPUs */
+	char buf[PERF_DUMP_MAX];
+	int len = 0;
+	int i;
+	struct perf_ctr_t * perf = &proc->perf;
+
+	len += snprintf(buf + len, PERF_DUMP_MAX - len,
+		ANSI_COLOR_BLUE "\t----- PID %2d performance counters -----\n"
+		"\tRetired:", proc->pid);
+	for (i = 0; i < NUM_OPCODES; i++) {
+		if (perf->ins_retired[i] != 0) {
+			len += snprintf(buf + len, PERF_DUMP_MAX - len,
+				" %s=%lu", opcode_name[i],
+				(unsigned long)perf->ins_retired[i]);
+		}
+	}
+	len += snprintf(buf + len, PERF_DUMP_MAX - len,
+		"\n\tPage faults: %lu\tSwap-in: %lu\tSwap-out: %lu\tLRU updates: %lu\tCOW copies: %lu\n"
+		"\tSlots running: %lu\tSlots waiting: %lu\tSlots blocked: %lu\n",
+		(unsigned long)perf->pgfault, (unsigned long)perf->swapin,
+		(unsigned long)perf->swapout, (unsigned long)perf->lru_update,
+		(unsigned long)perf->cowcopy,
+		(unsigned long)perf->slot_run, (unsigned long)perf->slot_wait,
+		(unsigned long)perf->slot_blocked);
+	len += snprintf(buf + len, PERF_DUMP_MAX - len,
+		"\tAlloc/free by size (<=256B <=1KB <=4KB >4KB):");
+	for (i = 0; i < PERF_NUM_SZCLASS; i++) {
+		len += snprintf(buf + len, PERF_DUMP_MAX - len, " %lu/%lu",
+			(unsigned long)perf->alloc[i],
+			(unsigned long)perf->free[i]);
+	}
+	snprintf(buf + len, PERF_DUMP_MAX - len,
+		"\n\t----------------------------------------\n" ANSI_COLOR_RESET);
+	fputs(buf, stdout);
+#else
+	(void)proc;
+#endif
+}
+
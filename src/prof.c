@@ -0,0 +1,143 @@
+
+#include "prof.h"
+#include "perf.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef PROFILE
+/* Profile of a program, summed over every process that ran it */
+struct prof_prog_t {
+	char * path;
+	uint32_t size;
+	uint32_t nproc;
+	enum ins_opcode_t * opcode;
+	uint32_t * line;
+	struct prof_ent_t * prof;
+	struct prof_prog_t * next;
+};
+
+static struct prof_prog_t * prog_list = NULL;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct prof_prog_t * prof_sort_prog;
+
+/* Hottest first: most slots, then most faults and swaps, then
+ * source order */
+static int prof_cmp(const void * a, const void * b) {
+	const struct prof_ent_t * x = &prof_sort_prog->prof[*(const uint32_t *)a];
+	const struct prof_ent_t * y = &prof_sort_prog->prof[*(const uint32_t *)b];
+	if (x->slot != y->slot) {
+		return (x->slot < y->slot) ? 1 : -1;
+	}
+	if (x->fault != y->fault) {
+		return (x->fault < y->fault) ? 1 : -1;
+	}
+	if (x->swap != y->swap) {
+		return (x->swap < y->swap) ? 1 : -1;
+	}
+	return (*(const uint32_t *)a < *(const uint32_t *)b) ? -1 : 1;
+}
+
+/* Program name without its directory, used as the root frame */
+static const char * prof_name(const char * path) {
+	const char * name = strrchr(path, '/');
+	return (name != NULL) ? name + 1 : path;
+}
+#endif
+
+void prof_collect(struct pcb_t * proc) {
+#ifdef PROFILE
+	struct code_seg_t * code = proc->code;
+	struct prof_prog_t * prog;
+	uint32_t i;
+
+	pthread_mutex_lock(&prof_lock);
+	for (prog = prog_list; prog != NULL; prog = prog->next) {
+		if (!strcmp(prog->path, code->path) && prog->size == code->size) {
+			break;
+		}
+	}
+	if (prog == NULL) {
+		prog = (struct prof_prog_t *)malloc(sizeof(struct prof_prog_t));
+		prog->path = strdup(code->path);
+		prog->size = code->size;
+		prog->nproc = 0;
+		prog->opcode = (enum ins_opcode_t *)malloc(sizeof(enum ins_opcode_t) * code->size);
+		prog->line = (uint32_t *)malloc(sizeof(uint32_t) * code->size);
+		prog->prof = (struct prof_ent_t *)calloc(code->size, sizeof(struct prof_ent_t));
+		for (i = 0; i < code->size; i++) {
+			prog->opcode[i] = code->text[i].opcode;
+			prog->line[i] = (code->line != NULL) ? code->line[i] : 0;
+		}
+		prog->next = prog_list;
+		prog_list = prog;
+	}
+	for (i = 0; i < code->size; i++) {
+		prog->prof[i].exec += proc->prof[i].exec;
+		prog->prof[i].slot += proc->prof[i].slot;
+		prog->prof[i].fault += proc->prof[i].fault;
+		prog->prof[i].swap += proc->prof[i].swap;
+	}
+	prog->nproc++;
+	pthread_mutex_unlock(&prof_lock);
+	free(proc->prof);
+	proc->prof = NULL;
+#else
+	(void)proc;
+#endif
+}
+
+void prof_report(const char * path) {
+#ifdef PROFILE
+	struct prof_prog_t * prog;
+	FILE * folded = fopen(path, "w");
+	if (folded == NULL) {
+		printf("Cannot write profile to %s\n", path);
+	}
+
+	pthread_mutex_lock(&prof_lock);
+	for (prog = prog_list; prog != NULL; prog = prog->next) {
+		uint32_t * order = (uint32_t *)malloc(sizeof(uint32_t) * prog->size);
+		uint32_t i, n = 0;
+		for (i = 0; i < prog->size; i++) {
+			if (prog->prof[i].exec > 0) {
+				order[n++] = i;
+			}
+		}
+		prof_sort_prog = prog;
+		qsort(order, n, sizeof(uint32_t), prof_cmp);
+
+		printf(ANSI_COLOR_BLUE "----- Profile of %s, %u process(es) -----\n"
+			"\t%6s %-8s %10s %10s %10s %10s\n",
+			prog->path, prog->nproc,
+			"line", "opcode", "executed", "slots", "faults", "swaps");
+		for (i = 0; i < n; i++) {
+			struct prof_ent_t * ent = &prog->prof[order[i]];
+			printf("\t%6u %-8s %10lu %10lu %10lu %10lu\n",
+				prog->line[order[i]], perf_opname(prog->opcode[order[i]]),
+				(unsigned long)ent->exec, (unsigned long)ent->slot,
+				(unsigned long)ent->fault, (unsigned long)ent->swap);
+			/* One frame per program and one per source line,
+			 * weighted by the slots spent on it */
+			if (folded != NULL) {
+				fprintf(folded, "%s;%u:%s %lu\n",
+					prof_name(prog->path), prog->line[order[i]],
+					perf_opname(prog->opcode[order[i]]),
+					(unsigned long)ent->slot);
+			}
+		}
+		printf(ANSI_COLOR_RESET);
+		free(order);
+	}
+	pthread_mutex_unlock(&prof_lock);
+	if (folded != NULL) {
+		fclose(folded);
+	}
+#else
+	(void)path;
+#endif
+}
+
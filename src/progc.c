@@ -0,0 +1,15 @@
+
+#include "loader.h"
+#include <stdio.h>
+
+/* Compile program texts to binaries the loader maps without parsing */
+int main(int argc, char * argv[]) {
+	if (argc != 3) {
+		printf("Usage: progc [program] [binary]\n");
+		return 1;
+	}
+	if (compile_code(argv[1], argv[2]) < 0) {
+		return 1;
+	}
+	return 0;
+}
@@ -13,14 +13,24 @@ void enqueue(struct queue_t * q, struct pcb_t * proc) {
          * Increase the number of Processe(s) in queue by 1
          * Put in the queue the new process
          */
-        if (q->size < MAX_QUEUE_SIZE) {
-                q->proc[q->size] = proc;
-                q->size++;
-        }
-        else {
-                printf("Error: queue_t has already been full\n");
-                exit(1);
+        if (q->size == q->cap) {
+                /* Unwrap the ring into a buffer twice as large */
+                int cap = q->cap ? q->cap * 2 : 16;
+                struct pcb_t ** buf = malloc(cap * sizeof(struct pcb_t *));
+                if (buf == NULL) {
+                        printf("Error: queue_t cannot grow\n");
+                        exit(1);
+                }
+                for (int i = 0; i < q->size; i++) {
+                        buf[i] = q->proc[(q->head + i) % q->cap];
+                }
+                free(q->proc);
+                q->proc = buf;
+                q->head = 0;
+                q->cap = cap;
         }
+        q->proc[(q->head + q->size) % q->cap] = proc;
+        q->size++;
 }
 
 struct pcb_t * dequeue(struct queue_t * q) {
@@ -31,10 +41,8 @@ struct pcb_t * dequeue(struct queue_t * q) {
                 perror("There are no process in this queue");
                 return NULL;
         }
-        struct pcb_t * front = q->proc[0];
-        for (int i = 0; i < q->size - 1; i++) {
-                q->proc[i] = q->proc[i + 1];
-        }
+        struct pcb_t * front = q->proc[q->head];
+        q->head = (q->head + 1) % q->cap;
         q->size--;
         return front;
 }
@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 static struct queue_t ready_queue;
 static struct queue_t run_queue;
 static pthread_mutex_t queue_lock;
@@ -36,11 +37,11 @@ void init_scheduler(void) {
     int i ;
 
 	for (i = 0; i < MAX_PRIO; i ++)
-		mlq_ready_queue[i].size = 0;
+		memset(&mlq_ready_queue[i], 0, sizeof(struct queue_t));
 	init_slot();
 #endif
-	ready_queue.size = 0;
-	run_queue.size = 0;
+	memset(&ready_queue, 0, sizeof(struct queue_t));
+	memset(&run_queue, 0, sizeof(struct queue_t));
 	pthread_mutex_init(&queue_lock, NULL);
 }
 
@@ -44,11 +44,16 @@ static void * timer_routine(void * args) {
 		/* Increase the time slot */
 		_time++;
 		
-		/* Let devices continue their job */
+		/* Let devices continue their job, devices that are
+		 * fast-forwarding stay parked until their skip runs out */
 		for (temp = dev_list; temp != NULL; temp = temp->next) {
 			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
+			if (temp->id.skip > 0) {
+				temp->id.skip--;
+			}else{
+				temp->id.done = 0;
+				pthread_cond_signal(&temp->id.timer_cond);
+			}
 			pthread_mutex_unlock(&temp->id.timer_lock);
 		}
 		if (fsh == event) {
@@ -76,6 +81,17 @@ void next_slot(struct timer_id_t * timer_id) {
 	pthread_mutex_unlock(&timer_id->timer_lock);
 }
 
+void next_slots(struct timer_id_t * timer_id, uint32_t n) {
+	if (n == 0) {
+		return;
+	}
+	/* The timer keeps us parked for the [n - 1] slots after this one */
+	pthread_mutex_lock(&timer_id->timer_lock);
+	timer_id->skip = n - 1;
+	pthread_mutex_unlock(&timer_id->timer_lock);
+	next_slot(timer_id);
+}
+
 uint64_t current_time() {
 	return _time;
 }
@@ -102,6 +118,7 @@ struct timer_id_t * attach_event() {
 			);
 		container->id.done = 0;
 		container->id.fsh = 0;
+		container->id.skip = 0;
 		pthread_cond_init(&container->id.event_cond, NULL);
 		pthread_mutex_init(&container->id.event_lock, NULL);
 		pthread_cond_init(&container->id.timer_cond, NULL);
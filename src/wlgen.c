@@ -0,0 +1,408 @@
+
+#include "common.h"
+#include "mm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Synthetic workload generator, writes a config at input/[name] and the
+ * programs it runs at input/proc/[name]_[k]. Every random choice comes
+ * from one seeded generator, so the same options give the same files */
+
+#define WL_NREGS	NUM_REGS	// Regions a program uses, also its registers
+#define WL_MAX_MIX	16
+
+enum wl_op_t {
+	WL_CALC, WL_ALLOC, WL_MALLOC, WL_FREE, WL_READ, WL_WRITE,
+	WL_FILL, WL_COPY, WL_IO, WL_SLEEP, WL_YIELD, WL_NUM_OPS
+};
+
+static const char * wl_op_name[WL_NUM_OPS] = {
+	"calc", "alloc", "malloc", "free", "read", "write",
+	"fill", "copy", "io", "sleep", "yield"
+};
+
+enum wl_locality_t { WL_UNIFORM, WL_ZIPF, WL_SEQ };
+
+static struct {
+	const char * name;
+	uint32_t nproc;
+	uint32_t nprog;
+	uint32_t length;	// Instructions per program
+	uint32_t cpus;
+	uint32_t slot;
+	int bursty;
+	double rate;	// Poisson arrivals per slot
+	uint32_t burst, gap;	// Bursty arrivals: [burst] processes every [gap] slots
+	uint32_t prio_lo, prio_hi;	// Uniform priorities, unless [nprio] > 0
+	uint32_t prio[WL_MAX_MIX];
+	double prio_w[WL_MAX_MIX];
+	int nprio;
+	double op_w[WL_NUM_OPS];
+	uint32_t rg_min, rg_max;
+	enum wl_locality_t locality;
+	double zipf_s;
+	uint32_t stride;
+	uint32_t ram, swp, vmem;
+	uint64_t seed;
+} wl;
+
+/* xorshift64*, good enough to pick instructions and fast at scale */
+static uint64_t wl_rng;
+
+static uint64_t rnd(void) {
+	wl_rng ^= wl_rng >> 12;
+	wl_rng ^= wl_rng << 25;
+	wl_rng ^= wl_rng >> 27;
+	return wl_rng * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+static double rnd_unit(void) {
+	return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Uniform in [lo, hi] */
+static uint32_t rnd_range(uint32_t lo, uint32_t hi) {
+	return lo + rnd() % ((uint64_t)hi - lo + 1);
+}
+
+static int rnd_weighted(const double * w, int n) {
+	double sum = 0, x;
+	int i;
+	for (i = 0; i < n; i++) {
+		sum += w[i];
+	}
+	x = rnd_unit() * sum;
+	for (i = 0; i < n - 1; i++) {
+		if (x < w[i]) {
+			return i;
+		}
+		x -= w[i];
+	}
+	return n - 1;
+}
+
+/* Regions of the program being generated */
+static struct {
+	uint32_t size;	// 0 if the region is not allocated
+	uint32_t cursor;	// Next offset of a sequential access
+} rg[WL_NREGS];
+
+/* Offset of an access of [len] bytes in region [r] */
+static uint32_t wl_offset(int r, uint32_t len) {
+	uint32_t span = rg[r].size - len + 1;
+	uint32_t off;
+
+	switch (wl.locality) {
+	case WL_ZIPF: {
+		/* Page k is hit with a weight of 1 / (k + 1)^s */
+		uint32_t npages = (span + PAGING_PAGESZ - 1) / PAGING_PAGESZ;
+		double sum = 0, x;
+		uint32_t k;
+		for (k = 0; k < npages; k++) {
+			sum += 1.0 / pow(k + 1, wl.zipf_s);
+		}
+		x = rnd_unit() * sum;
+		for (k = 0; k + 1 < npages; k++) {
+			x -= 1.0 / pow(k + 1, wl.zipf_s);
+			if (x < 0) {
+				break;
+			}
+		}
+		off = k * PAGING_PAGESZ + rnd() % PAGING_PAGESZ;
+		return (off < span) ? off : span - 1;
+	}
+	case WL_SEQ:
+		off = rg[r].cursor % span;
+		rg[r].cursor = off + wl.stride;
+		return off;
+	default:
+		return rnd() % span;
+	}
+}
+
+static int pick_region(int allocated) {
+	int cand[WL_NREGS], n = 0, r;
+	for (r = 0; r < WL_NREGS; r++) {
+		if ((rg[r].size > 0) == allocated) {
+			cand[n++] = r;
+		}
+	}
+	return (n > 0) ? cand[rnd() % n] : -1;
+}
+
+static int write_program(const char * path, uint32_t prio) {
+	FILE * file = fopen(path, "w");
+	uint32_t i;
+	if (file == NULL) {
+		printf("Cannot write program at %s\n", path);
+		return -1;
+	}
+	memset(rg, 0, sizeof(rg));
+	fprintf(file, "%u %u\n", prio, wl.length);
+	for (i = 0; i < wl.length; i++) {
+		enum wl_op_t op = rnd_weighted(wl.op_w, WL_NUM_OPS);
+		int r = -1, d;
+		uint32_t len;
+
+		/* An access needs a region and an allocation a free one,
+		 * fall back to what the program can do */
+		if (op >= WL_FREE && op <= WL_COPY) {
+			if ((r = pick_region(1)) < 0) {
+				op = WL_ALLOC;
+			}
+		}
+		if ((op == WL_ALLOC || op == WL_MALLOC) && (r = pick_region(0)) < 0) {
+			op = WL_CALC;
+		}
+		switch (op) {
+		case WL_ALLOC:
+		case WL_MALLOC:
+			rg[r].size = rnd_range(wl.rg_min, wl.rg_max);
+			rg[r].cursor = 0;
+			fprintf(file, "%s %u %d\n", wl_op_name[op], rg[r].size, r);
+			break;
+		case WL_FREE:
+			rg[r].size = 0;
+			fprintf(file, "free %d\n", r);
+			break;
+		case WL_READ:
+			fprintf(file, "read %d %u %u\n", r, wl_offset(r, 1), (uint32_t)(rnd() % NUM_REGS));
+			break;
+		case WL_WRITE:
+			fprintf(file, "write %u %d %u\n", (uint32_t)(rnd() % 256), r, wl_offset(r, 1));
+			break;
+		case WL_FILL:
+			len = rnd_range(1, rg[r].size);
+			fprintf(file, "fill %u %d %u %u\n", (uint32_t)(rnd() % 256), r, wl_offset(r, len), len);
+			break;
+		case WL_COPY:
+			d = pick_region(1);
+			len = rnd_range(1, (rg[r].size < rg[d].size) ? rg[r].size : rg[d].size);
+			fprintf(file, "copy %d %u ", r, wl_offset(r, len));
+			fprintf(file, "%d %u %u\n", d, wl_offset(d, len), len);
+			break;
+		case WL_IO:
+		case WL_SLEEP:
+			fprintf(file, "%s %u\n", wl_op_name[op], rnd_range(1, 4));
+			break;
+		default:
+			fprintf(file, "%s\n", wl_op_name[op]);
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+static uint32_t pick_prio(void) {
+	if (wl.nprio > 0) {
+		return wl.prio[rnd_weighted(wl.prio_w, wl.nprio)];
+	}
+	return rnd_range(wl.prio_lo, wl.prio_hi);
+}
+
+static int bad_option(char opt, const char * arg) {
+	printf("Invalid value '%s' for -%c\n", arg, opt);
+	return 1;
+}
+
+/* [list] is "key:weight,key:weight,...", keys are looked up in [names]
+ * or, without [names], read as numbers into [keys] */
+static int parse_mix(char opt, char * list, const char ** names, int nnames,
+		uint32_t * keys, double * w, int max) {
+	char * item, * save = NULL;
+	int n = 0, i;
+
+	if (names != NULL) {
+		for (i = 0; i < nnames; i++) {
+			w[i] = 0;
+		}
+	}
+	for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		char * colon = strchr(item, ':');
+		if (colon == NULL) {
+			bad_option(opt, item);
+			return -1;
+		}
+		*colon = '\0';
+		if (names != NULL) {
+			for (i = 0; i < nnames && strcmp(item, names[i]); i++)
+				;
+			if (i == nnames) {
+				bad_option(opt, item);
+				return -1;
+			}
+			w[i] = atof(colon + 1);
+		}else{
+			if (n == max) {
+				bad_option(opt, item);
+				return -1;
+			}
+			keys[n] = strtoul(item, NULL, 10);
+			w[n++] = atof(colon + 1);
+		}
+	}
+	return n;
+}
+
+static void usage(void) {
+	printf("Usage: wlgen -o [name] [options]\n"
+		"\t-n [count]            processes (100)\n"
+		"\t-P [count]            distinct programs (32, at most one per process)\n"
+		"\t-l [count]            instructions per program (30)\n"
+		"\t-c [count]            CPUs (2)\n"
+		"\t-t [slots]            time slice (2)\n"
+		"\t-a poisson:[rate]     arrivals per slot on average (poisson:1)\n"
+		"\t-a burst:[size]:[gap] [size] arrivals every [gap] slots\n"
+		"\t-p uniform:[lo]:[hi]  priorities (uniform:0:%d)\n"
+		"\t-p [prio]:[weight],...\n"
+		"\t-m [op]:[weight],...  instruction mix, op is one of calc alloc malloc\n"
+		"\t                      free read write fill copy io sleep yield\n"
+		"\t-r [min]:[max]        region size in bytes (64:2048)\n"
+		"\t-x uniform|zipf:[s]|seq:[stride]  locality of accesses (uniform)\n"
+		"\t-M [ram]:[swap]:[vmem] memory sizes (1048576:16777216:3145728)\n"
+		"\t-s [seed]             seed (1)\n", MAX_PRIO - 1);
+}
+
+int main(int argc, char * argv[]) {
+	char * path;
+	FILE * cfg;
+	double t = 0;
+	uint32_t i;
+	int opt;
+
+	memset(&wl, 0, sizeof(wl));
+	wl.nproc = 100;
+	wl.nprog = 32;
+	wl.length = 30;
+	wl.cpus = 2;
+	wl.slot = 2;
+	wl.rate = 1;
+	wl.prio_hi = MAX_PRIO - 1;
+	wl.op_w[WL_CALC] = 40;
+	wl.op_w[WL_ALLOC] = 10;
+	wl.op_w[WL_MALLOC] = 5;
+	wl.op_w[WL_FREE] = 10;
+	wl.op_w[WL_READ] = 15;
+	wl.op_w[WL_WRITE] = 15;
+	wl.op_w[WL_IO] = 3;
+	wl.op_w[WL_YIELD] = 2;
+	wl.rg_min = 64;
+	wl.rg_max = 2048;
+	wl.ram = 1048576;
+	wl.swp = 16777216;
+	wl.vmem = 3145728;
+	wl.seed = 1;
+
+	while ((opt = getopt(argc, argv, "o:n:P:l:c:t:a:p:m:r:x:M:s:")) != -1) {
+		switch (opt) {
+		case 'o': wl.name = optarg; break;
+		case 'n': wl.nproc = strtoul(optarg, NULL, 10); break;
+		case 'P': wl.nprog = strtoul(optarg, NULL, 10); break;
+		case 'l': wl.length = strtoul(optarg, NULL, 10); break;
+		case 'c': wl.cpus = strtoul(optarg, NULL, 10); break;
+		case 't': wl.slot = strtoul(optarg, NULL, 10); break;
+		case 's': wl.seed = strtoull(optarg, NULL, 10); break;
+		case 'a':
+			if (sscanf(optarg, "poisson:%lf", &wl.rate) == 1 && wl.rate > 0) {
+				wl.bursty = 0;
+			}else if (sscanf(optarg, "burst:%u:%u", &wl.burst, &wl.gap) == 2 && wl.burst > 0) {
+				wl.bursty = 1;
+			}else{
+				return bad_option(opt, optarg);
+			}
+			break;
+		case 'p':
+			if (!strncmp(optarg, "uniform:", 8)) {
+				if (sscanf(optarg, "uniform:%u:%u", &wl.prio_lo, &wl.prio_hi) != 2
+						|| wl.prio_lo > wl.prio_hi) {
+					return bad_option(opt, optarg);
+				}
+				wl.nprio = 0;
+			}else if ((wl.nprio = parse_mix(opt, optarg, NULL, 0, wl.prio, wl.prio_w, WL_MAX_MIX)) <= 0) {
+				return 1;
+			}
+			for (i = 0; i < (uint32_t)wl.nprio; i++) {
+				if (wl.prio[i] >= MAX_PRIO) {
+					return bad_option(opt, "priority");
+				}
+			}
+			if (wl.nprio == 0 && wl.prio_hi >= MAX_PRIO) {
+				return bad_option(opt, optarg);
+			}
+			break;
+		case 'm':
+			if (parse_mix(opt, optarg, wl_op_name, WL_NUM_OPS, NULL, wl.op_w, WL_NUM_OPS) < 0) {
+				return 1;
+			}
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u:%u", &wl.rg_min, &wl.rg_max) != 2
+					|| wl.rg_min == 0 || wl.rg_min > wl.rg_max) {
+				return bad_option(opt, optarg);
+			}
+			break;
+		case 'x':
+			if (!strcmp(optarg, "uniform")) {
+				wl.locality = WL_UNIFORM;
+			}else if (sscanf(optarg, "zipf:%lf", &wl.zipf_s) == 1) {
+				wl.locality = WL_ZIPF;
+			}else if (sscanf(optarg, "seq:%u", &wl.stride) == 1) {
+				wl.locality = WL_SEQ;
+			}else{
+				return bad_option(opt, optarg);
+			}
+			break;
+		case 'M':
+			if (sscanf(optarg, "%u:%u:%u", &wl.ram, &wl.swp, &wl.vmem) != 3) {
+				return bad_option(opt, optarg);
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (wl.name == NULL || wl.nproc == 0 || wl.nprog == 0 || wl.cpus == 0 || wl.slot == 0) {
+		usage();
+		return 1;
+	}
+	if (wl.nprog > wl.nproc) {
+		wl.nprog = wl.nproc;
+	}
+	wl_rng = wl.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	path = (char *)malloc(strlen(wl.name) + 32);
+	for (i = 0; i < wl.nprog; i++) {
+		sprintf(path, "input/proc/%s_%u", wl.name, i);
+		if (write_program(path, pick_prio()) < 0) {
+			return 1;
+		}
+	}
+
+	sprintf(path, "input/%s", wl.name);
+	if ((cfg = fopen(path, "w")) == NULL) {
+		printf("Cannot write configure file at %s\n", path);
+		return 1;
+	}
+	fprintf(cfg, "%u %u %u\n", wl.slot, wl.cpus, wl.nproc);
+	fprintf(cfg, "%u %u 0 0 0 %u\n", wl.ram, wl.swp, wl.vmem);
+	for (i = 0; i < wl.nproc; i++) {
+		uint64_t start;
+		if (wl.bursty) {
+			start = (uint64_t)(i / wl.burst) * wl.gap;
+		}else{
+			/* Exponential gaps between arrivals */
+			t += -log(1.0 - rnd_unit()) / wl.rate;
+			start = (uint64_t)t;
+		}
+		fprintf(cfg, "%lu %s_%u %u\n", start, wl.name, (uint32_t)(rnd() % wl.nprog), pick_prio());
+	}
+	fclose(cfg);
+	free(path);
+	return 0;
+}
+